@@ -0,0 +1,38 @@
+/* libsqpix: sqpix without the command-line, converting images in memory.
+   Build sqpix.c with -DSQPIX_LIB (make lib) and link with the encoders.
+
+	sqpix *ctx = sqpix_new();
+	sqpix_options(ctx, "--zx0 --o4 -r 4:3");
+	if(sqpix_convert(ctx, rgb, w, h, &sqp, &len, NULL) == 0) {
+		...
+		free(sqp);
+	} else puts(sqpix_error(ctx));
+	sqpix_free(ctx);
+
+   A context is used by one thread at a time, but several contexts can
+   run in parallel. Its dither cache stays warm from one call to the
+   next, which changes the speed but not the result. */
+#ifndef LIBSQPIX_H
+#define LIBSQPIX_H
+
+typedef struct sqpix sqpix;
+
+/* a context with the default options, NULL if out of memory */
+sqpix *sqpix_new(void);
+void sqpix_free(sqpix *ctx);
+
+/* sets options as on the command-line ("--exo --hex"), without input
+   file. The global ones (-j, --store...) are ignored. Returns 0, or -1
+   with the message in sqpix_error(). */
+int sqpix_options(sqpix *ctx, const char *args);
+
+/* converts the w x h RGB (3 bytes per pixel, sRGB) image into a SQP
+   file. *sqp is allocated, to be freed by the caller. When not NULL,
+   preview receives the 256x256 RGB pixels displayed (196608 bytes).
+   Returns 0, or -1 with the message in sqpix_error(). */
+int sqpix_convert(sqpix *ctx, const unsigned char *rgb, int w, int h,
+                  unsigned char **sqp, int *len, unsigned char *preview);
+
+const char *sqpix_error(const sqpix *ctx);
+
+#endif
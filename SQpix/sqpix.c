@@ -5,7 +5,28 @@
 #include <assert.h>
 #include <float.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#else
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>			/* GetSystemInfo() */
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "stb/stb_ds.h"
 #include "stb/stb_image.h"
@@ -19,6 +40,8 @@
 #include "membuf_io.h"
 #include "exo_helper.h"
 
+#include "libsqpix.h"
+
 #define length_of(array) (sizeof(array)/sizeof(array[0]))
 
 #ifndef TRUE
@@ -41,6 +64,34 @@
 // #define HALF_INTENSITY	127
 
 #define DITH_MAX		64
+#define DITH_BASE		96 //109
+
+/* values for use_cache */
+#define CACHE_NONE		0
+#define CACHE_HASH		1
+#define CACHE_LUT		2
+
+/* versions of the SQP format */
+#define SQP_RAW			1
+#define SQP_EXO			2
+#define SQP_ZX0			3
+#define SQP_SPAN		4
+
+#define SECTOR_SIZE		252	/* data bytes of a FLEX sector */
+
+/* stages of a conversion, timed for --bench */
+#define STAGE_LOAD		0
+#define STAGE_RESIZE		1
+#define STAGE_NORM		2
+#define STAGE_DITHER		3
+#define STAGE_COMPRESS		4
+#define STAGE_WRITE		5
+#define STAGES			6
+
+/* hot path counters of --stats and --debug, 0 compiles them out */
+#ifndef SQPIX_STATS
+#define SQPIX_STATS		1
+#endif
 
 PRIVATE uint8_t dith_vac[8][8] = {
 	{40,61, 2,39,19,43,23, 8},
@@ -318,14 +369,56 @@ PRIVATE struct dith_descriptor dith_descriptors[] = {
 	DITH_DESCRIPTOR("h3r",   36, dith_h3r,	     "Halftone 6x6 (rotated)"),
 	
 	{NULL}
-}, *dith_descriptor;
+};
 
-PRIVATE uint8_t exo  = FALSE, zx0 = FALSE, use_cache = TRUE;
-PRIVATE uint8_t verbose  = FALSE, pgm  = FALSE, png  = FALSE, gif = FALSE;
-PRIVATE char *input_file, *output_file = "%p/%N.SQP";
+/* options as set by the command-line. A copy is taken for each input 
+   file so that parallel jobs do not see the changes made by parse() */
+typedef struct options {
+	struct dith_descriptor *dith_descriptor;
+	char *output_file;
+	float aspect_ratio, norm_b, norm_w;
+	uint8_t exo, zx0, span, use_cache;
+	uint8_t verbose, pgm, png, gif;
+	uint8_t centered, hq_zoom, hilbert;
+	uint8_t dith_threads;
+	uint8_t search_threads;
+	float search_time;		/* seconds, <0 for no limit */
+	uint8_t incremental;
+	const char *optimize_size;	/* dithers to try, "" for same size */
+	uint8_t best;
+	uint8_t verify;
+	int decode_bench;		/* decodes per file, 0 for none */
+	float target_time;		/* seconds, <0 for none */
+} options;
+
+PRIVATE options opt = {
+	NULL, "%p/%N.SQP", 1.0f, -1.0f, -1.0f,
+	FALSE, FALSE, FALSE, CACHE_HASH,
+	FALSE, FALSE, FALSE, FALSE,
+	TRUE, TRUE, FALSE,
+	0,
+	0, -1.0f,
+	FALSE,
+	NULL,
+	FALSE,
+	FALSE, 0,
+	-1.0f
+};
 
-PRIVATE uint8_t centered = TRUE, hq_zoom = TRUE,  hilbert = FALSE;
-PRIVATE float aspect_ratio = 1.0f, norm_b = -1.0f, norm_w = -1.0f;
+PRIVATE char *input_file;
+PRIVATE int threads = 0;
+PRIVATE char *cache_file = NULL;
+PRIVATE char *store_dir = NULL;
+PRIVATE char *bench_file = NULL, *bench_baseline = NULL;
+PRIVATE char *stats_file = NULL;
+PRIVATE FILE *stats_out = NULL;
+PRIVATE char *serve_path = NULL;
+PRIVATE int parse_soft = FALSE;		/* parse() reads a request or sqpix_options() */
+PRIVATE char parse_error[256];
+PRIVATE int bench_runs = 3;
+PRIVATE int exit_code = 0;
+PRIVATE double decode_time = 0;		/* --decode-bench totals */
+PRIVATE long decode_pixels = 0;
 
 typedef float vec3[3];
 
@@ -449,29 +542,44 @@ typedef struct tetra {
 	struct tetra *prev, *next;
 } tetra;
 
-PRIVATE color palette[15];
-
-PRIVATE int float_cmp(float x, float y) {
-	return x<y ? -1 : x>y ? +1 : 0;
-}
-
-PRIVATE int intens_cmp(const void *pa, const void *pb) {
-	const float * a = pa, *b = pb;
-	return float_cmp(*a, *b);
-}
-
-PRIVATE int color_cmp_by_intens(const void *pa, const void *pb) {
-	const color * const *a = pa, * const *b = pb;
-	return float_cmp((*a)->intens, (*b)->intens);
-}
+/* counters of a conversion, all doubles (see stats_add) */
+typedef struct stats {
+	double dith_total, dith_hit;		/* cache probes and hits */
+	double tetra_miss, tetra_tested;	/* searches and tetras tested */
+	double tetra_moves;			/* LRU reorders */
+	double proj2, proj3;			/* tetra_coord() on an edge, face */
+	double pixels, samples;			/* source samples averaged */
+	double comp_in, comp_out;		/* exomizer and ZX0 bytes */
+} stats;
+
+#if SQPIX_STATS
+#define STAT(s, field, n)	((s)->field += (n))
+#else
+#define STAT(s, field, n)	((void)(n))
+#endif
 
-PRIVATE int color_cmp_by_weight(const void *pa, const void *pb) {
-	const color * const *a = pa, * const *b = pb;
-	return -float_cmp((*a)->weight, (*b)->weight);
+PRIVATE void stats_add(stats *a, const stats *b) {
+	double *x = (double*)a;
+	const double *y = (const double*)b;
+	int i;
+	for(i = 0; i < (int)(sizeof(stats)/sizeof(double)); ++i) x[i] += y[i];
 }
 
-PRIVATE void set_palette(int i, float r, float g, float b) {
-	color *c = &palette[i];
+/* dither state. Everything here gets modified while dithering (weights,
+   LRU order of the tetras, cache), so each thread needs its own copy. */
+typedef struct worker {
+	color palette[15];
+	tetra tetras[27], *tetra_list;
+	struct dith_cache *dith_cache;
+	struct dith_lut *dith_lut;
+	int dith_lut_len;
+	stats stats;
+} worker;
+
+PRIVATE worker main_worker;
+
+PRIVATE void set_palette(worker *wk, int i, float r, float g, float b) {
+	color *c = &wk->palette[i];
 	vec3_set(&c->pt, r,g,b);
 	c->index  = i;
 	c->intens = 
@@ -479,22 +587,20 @@ PRIVATE void set_palette(int i, float r, float g, float b) {
 		//.2126f*r +.7152f*g  + .0722f*b;
 }
 
-PRIVATE tetra tetras[27], *tetra_list;
-
-PRIVATE void new_tetra(tetra *tetra, int a, int b, int c, int d) {
+PRIVATE void new_tetra(worker *wk, tetra *tetra, int a, int b, int c, int d) {
 	vec3 p01,p02,p03,p12,p13;
 	color **T = tetra->p;
 
-	T[0] = &palette[a];
-	T[1] = &palette[b];
-	T[2] = &palette[c];
-	T[3] = &palette[d];
+	T[0] = &wk->palette[a];
+	T[1] = &wk->palette[b];
+	T[2] = &wk->palette[c];
+	T[3] = &wk->palette[d];
 			
 	tetra->prev = NULL;
-	tetra->next = tetra_list;
+	tetra->next = wk->tetra_list;
 	if(tetra->next) 
 	tetra->next->prev = tetra;
-	tetra_list = tetra;
+	wk->tetra_list = tetra;
 	
 	vec3_sub(&p01, &T[1]->pt, &T[0]->pt);
 	vec3_sub(&p02, &T[2]->pt, &T[0]->pt);
@@ -604,9 +710,12 @@ PRIVATE void tetra_proj2(float *w0, float *w1, vec3 *p, vec3 *v0, vec3 *v1) {
 	*w0 = 1-t; *w1 = t;
 }
 
-PRIVATE void tetra_coord(tetra *tetra, vec3 *p, vec3 *b) {
+/* barycentric weights of p in the tetra, or of its projection on the 
+   closest vertex, edge or face. Returns the number of non-zero ones. */
+PRIVATE int tetra_coord(tetra *tetra, vec3 *p, vec3 *b) {
 	color **T = tetra->p; 
 	float w0,w1,w2,w3;
+	int n = 4;
 	
 	do {	vec3 q;
 
@@ -632,55 +741,69 @@ PRIVATE void tetra_coord(tetra *tetra, vec3 *p, vec3 *b) {
 			if(w2 < 0) {
 				w3 = 1;
 				w0 = w1 = w2 = 0;
+				n = 1;
 			} else if(w3 < 0) {
 				w2 = 1;
 				w0 = w1 = w3 = 0;
+				n = 1;
 			} else {
 				tetra_proj2(&w2, &w3, p, &T[2]->pt, &T[3]->pt);
 				w0 = w1 = 0;
+				n = 2;
 			}
 		} else if(w2 < 0) {
 			if(w3 < 0) {
 				w1 = 1;
 				w0 = w2 = w3 = 0;
+				n = 1;
 			} else {
 				tetra_proj2(&w1, &w3, p, &T[1]->pt, &T[3]->pt);
 				w0 = w2 = 0;
+				n = 2;
 			}
 		} else if(w3 < 0) {
 			tetra_proj2(&w1, &w2, p, &T[1]->pt, &T[2]->pt);
 			w0 = w3 = 0;
+			n = 2;
 		} else {
 			tetra_proj3(&w1, &w2, &w3, p, &T[1]->pt, &T[2]->pt, &T[3]->pt);
 			w0 = 0;
+			n = 3;
 		}
 	} else if(w1 < 0) {
 		if(w2 < 0) {
 			if(w3 < 0) {
 				w0 = 1;
 				w1 = w2 = w3 = 0;
+				n = 1;
 			} else {
 				tetra_proj2(&w0, &w3, p, &T[0]->pt, &T[3]->pt);
 				w1 = w2 = 0;
+				n = 2;
 			}
 		} else if(w3 < 0) {
 			tetra_proj2(&w0, &w2, p, &T[0]->pt, &T[2]->pt);
 			w1 = w3 = 0;
+			n = 2;
 		} else {
 			tetra_proj3(&w0, &w2, &w3, p, &T[0]->pt, &T[2]->pt, &T[3]->pt);
 			w1 = 0;
+			n = 3;
 		}
 	} else if(w2 < 0) {
 		if(w3 < 0) {
 			tetra_proj2(&w0, &w1, p, &T[0]->pt, &T[1]->pt);
 			w2 = w3 = 0;
+			n = 2;
 		} else {
 			tetra_proj3(&w0, &w1, &w3, p, &T[0]->pt, &T[1]->pt, &T[3]->pt);
 			w2 = 0;
+			n = 3;
 		}
 	} else {
 		tetra_proj3(&w0, &w1, &w2, p, &T[0]->pt, &T[1]->pt, &T[2]->pt);
 		w3 = 0;
+		n = 3;
 	}
 	
 	T[0]->weight = w0;
@@ -697,371 +820,1339 @@ PRIVATE void tetra_coord(tetra *tetra, vec3 *p, vec3 *b) {
 			(*b)[i] = x<0.0f ? 0.0f : x>1.0f ? 1.0f : x;
 		}
 	}
+	
+	return n;
 }
 
-PRIVATE float sRGB2lin(uint8_t sRGB) {
-	static float tab[256];
-	
-	if(tab[255]==0) {
-		int i;
-		for(i=0;i<256;++i) {
-			float x = i/255.0f;
-			tab[i] = x<=0.04045f ? x/12.92f : powf((x+0.055f)/1.055f, 2.4f);
-		}
+/* Colors are 16 bits linear integers up to the cache key, the floats 
+   being only needed to solve the misses. The tables are filled by 
+   init(), before any thread uses them. */
+PRIVATE float    lin_tab[256];
+PRIVATE uint16_t lin16_tab[256];
+
+PRIVATE void lin_init(void) {
+	int i;
+	for(i=0;i<256;++i) {
+		float x = i/255.0f;
+		lin_tab[i] = x<=0.04045f ? x/12.92f : powf((x+0.055f)/1.055f, 2.4f);
+		lin16_tab[i] = 0.5f + 65535*lin_tab[i];
 	}
-	
-	return tab[sRGB];
+}
+
+PRIVATE float sRGB2lin(uint8_t sRGB) {
+	return lin_tab[sRGB];
 }	
 
-PRIVATE uint32_t dith_key(vec3 *p) {
-	float *v = &(*p)[0];
-	const int base = 96;//109;
-	return  base*base*(uint32_t)(0.5f + v[0]*(base-1))
-		+    base*(uint32_t)(0.5f + v[1]*(base-1))
-		+         (uint32_t)(0.5f + v[2]*(base-1));
- }
+PRIVATE uint16_t sRGB2lin16(uint8_t sRGB) {
+	return lin16_tab[sRGB];
+}
+
+PRIVATE vec3 *rgb16_vec3(const uint16_t *c, vec3 *p) {
+	return vec3_set(p, c[0]/65535.0f, c[1]/65535.0f, c[2]/65535.0f);
+}
+
+PRIVATE uint32_t dith_key(const uint16_t *c) {
+	const uint32_t base = DITH_BASE;
+	return  base*base*((c[0]*(base-1) + 32767)/65535)
+		+    base*((c[1]*(base-1) + 32767)/65535)
+		+         ((c[2]*(base-1) + 32767)/65535);
+}
+
+/* the color at the center of the cell of a key. The cached ramps are 
+   solved there, so that they don't depend on the first color of the
+   cell met, and thus on the images converted before. */
+PRIVATE vec3 *dith_center(const uint32_t key, vec3 *p) {
+	const uint32_t base = DITH_BASE;
+	const float s = 1.0f/(base-1);
+	return vec3_set(p, (key/(base*base))*s, (key/base % base)*s, (key % base)*s);
+}
 
-PRIVATE struct dith_cache {
+struct dith_cache {
 	uint32_t key;
 	uint8_t  value[DITH_MAX];
-} *dith_cache;
-PRIVATE double dith_total, dith_hit;
+};
 
-PRIVATE tetra *dith_find_tetra(vec3 *p) {
-	float w0 = 0, w1 = 0, w2 = 0, w3 = 0;
-	float  best_d = FLT_MAX;
-	tetra *best_t = NULL, *t;
+/* compact alternative to dith_cache, directly indexed by the key. The 
+   ramp has at most 4 colors (sorted by intensity): level v gets color
+   number (v>=limit[0]) + (v>=limit[1]) + (v>=limit[2]). */
+struct dith_lut {
+	uint8_t color[4];
+	uint8_t limit[3];
+	uint8_t valid;
+};
 
-	for(t = tetra_list; t; t = t->next) {
-		float d; vec3 q;
+#define DITH_EPS	1e-5f
+
+/* Uniform grid over the RGB cube, each cell listing the tetras whose
+   bounding box is closer than TETRA_GRID_GAP, the ones covering most of
+   the cell first. A point strictly inside a listed tetra, or closer to 
+   a listed one than any unlisted tetra can be, doesn't need to look any
+   further. 0 disables the grid. */
+#define TETRA_GRID	16
+#define TETRA_GRID_GAP	1e-3f
+
+#if TETRA_GRID
+PRIVATE struct tetra_cell {
+	uint32_t first;
+	uint8_t  count;
+} tetra_cell[TETRA_GRID*TETRA_GRID*TETRA_GRID];
+PRIVATE uint8_t *tetra_cand;
+
+PRIVATE int tetra_grid_cell(vec3 *p) {
+	int i, c = 0;
+	for(i = 0; i < 3; ++i) {
+		int x = (int)((*p)[i]*TETRA_GRID);
+		c = c*TETRA_GRID + (x<0 ? 0 : x>=TETRA_GRID ? TETRA_GRID-1 : x);
+	}
+	return c;
+}
+#endif
 
-		tetra_coord(t, p, &q);
+/* tests p against t, keeping track of the closest tetra. Returns TRUE 
+   if p is strictly inside t. */
+PRIVATE int dith_try_tetra(worker *wk, tetra *t, vec3 *p, 
+                           float *best_d, tetra **best_t, float w[4]) {
+	float d; vec3 q;
+	int n;
+	
+	STAT(&wk->stats, tetra_tested, 1);
+	n = tetra_coord(t, p, &q);
+	STAT(&wk->stats, proj2, n == 2);
+	STAT(&wk->stats, proj3, n == 3);
 		
-		vec3_sub(&q, &q, p);
-		d = vec3_dot(&q, &q);
-		if(d < best_d) {
-			best_d = d;
-			best_t = t;
-			w0 = t->p[0]->weight;
-			w1 = t->p[1]->weight;
-			w2 = t->p[2]->weight;
-			w3 = t->p[3]->weight;
-			if(d <= 1e-5) break; /* shortcut */
-		}
+	if(t->p[0]->weight > DITH_EPS && t->p[1]->weight > DITH_EPS
+	&& t->p[2]->weight > DITH_EPS && t->p[3]->weight > DITH_EPS) {
+		*best_t = t;
+		w[0] = t->p[0]->weight;
+		w[1] = t->p[1]->weight;
+		w[2] = t->p[2]->weight;
+		w[3] = t->p[3]->weight;
+		return TRUE;
+	}
+		
+	vec3_sub(&q, &q, p);
+	d = vec3_dot(&q, &q);
+	if(d < *best_d || (d == *best_d && t < *best_t)) {
+		*best_d = d;
+		*best_t = t;
+		w[0] = t->p[0]->weight;
+		w[1] = t->p[1]->weight;
+		w[2] = t->p[2]->weight;
+		w[3] = t->p[3]->weight;
 	}
+	return FALSE;
+}
+
+/* The result only depends on p, not on the LRU order: a point strictly 
+   inside a tetra can't be in any other one, and otherwise the closest
+   tetra wins, ties going to the first one in the tetras[] array. This
+   is what makes the threaded dithering identical to the serial one. */
+PRIVATE tetra *dith_find_tetra(worker *wk, vec3 *p) {
+	float  w[4] = {0, 0, 0, 0};
+	float  best_d = FLT_MAX;
+	tetra *best_t = NULL, *t;
+	
+	STAT(&wk->stats, tetra_miss, 1);
+	
+#if TETRA_GRID
+	do {
+		const struct tetra_cell *c = &tetra_cell[tetra_grid_cell(p)];
+		const uint8_t *cand = tetra_cand + c->first;
+		int i, found = FALSE;
+		
+		for(i = 0; i < c->count && !found; ++i) 
+			found = dith_try_tetra(wk, &wk->tetras[cand[i]], p, &best_d, &best_t, w);
+		
+		if(!found && best_d >= TETRA_GRID_GAP*TETRA_GRID_GAP/4) {
+			/* outside of the hull: full search */
+			best_d = FLT_MAX; best_t = NULL;
+			for(t = wk->tetra_list; t; t = t->next) 
+				if(dith_try_tetra(wk, t, p, &best_d, &best_t, w)) break;
+		}
+	} while(0);
+#else	
+	for(t = wk->tetra_list; t; t = t->next) 
+		if(dith_try_tetra(wk, t, p, &best_d, &best_t, w)) 
+			break; /* shortcut */
+#endif
 
 	/* move found to first place.
 	   idea here is to have an LRU organisation
 	 */
-	if(best_t != tetra_list) {
+	if(best_t != wk->tetra_list) {
+		STAT(&wk->stats, tetra_moves, 1);
 		if(best_t->next) 
 		best_t->next->prev = best_t->prev;
 		best_t->prev->next = best_t->next;
 		
-		tetra_list->prev = best_t;
-		best_t->next = tetra_list;
+		wk->tetra_list->prev = best_t;
+		best_t->next = wk->tetra_list;
 		best_t->prev = NULL;
 		
-		tetra_list = best_t;
+		wk->tetra_list = best_t;
 	}
 	
-	best_t->p[0]->weight = w0;
-	best_t->p[1]->weight = w1;
-	best_t->p[2]->weight = w2;
-	best_t->p[3]->weight = w3;
+	best_t->p[0]->weight = w[0];
+	best_t->p[1]->weight = w[1];
+	best_t->p[2]->weight = w[2];
+	best_t->p[3]->weight = w[3];
 		
 	return best_t;
 }
 
-PRIVATE uint8_t dith(const struct dith_descriptor *dith, 
-                     const int x, const int y, vec3 *p) {
-	const uint32_t key = use_cache ? dith_key(p) : 1; 
-	struct dith_cache *cache;
+/* a point located by dith_find_batch() */
+struct tetra_hit {
+	tetra *t;
+	float w[4];
+};
+
+#define DITH_BATCH	8
+
+#if TETRA_GRID
+/* SoA copy of the tetras for the batched search, indexed by tetra: the
+   origin and normal of the plane giving each weight, one array per 
+   coordinate. */
+PRIVATE struct {
+	float o[4][3][length_of(((worker*)0)->tetras)];
+	float n[4][3][length_of(((worker*)0)->tetras)];
+} tetra_soa;
+
+#if defined(__AVX2__)
+#define SIMD_LANES	8
+typedef __m256 simd_f;
+#define simd_load(p)		_mm256_loadu_ps(p)
+#define simd_store(p, v)	_mm256_storeu_ps(p, v)
+#define simd_gather(a, id)	_mm256_i32gather_ps(a, _mm256_loadu_si256((const __m256i*)(id)), 4)
+#define simd_set1(x)		_mm256_set1_ps(x)
+#define simd_add(a, b)		_mm256_add_ps(a, b)
+#define simd_sub(a, b)		_mm256_sub_ps(a, b)
+#define simd_mul(a, b)		_mm256_mul_ps(a, b)
+#define simd_div(a, b)		_mm256_div_ps(a, b)
+#define simd_ge(a, b)		_mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define simd_gt(a, b)		_mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define simd_and(a, b)		_mm256_and_ps(a, b)
+#define simd_mask(a)		_mm256_movemask_ps(a)
+#elif defined(__SSE2__)
+#define SIMD_LANES	4
+typedef __m128 simd_f;
+#define simd_load(p)		_mm_loadu_ps(p)
+#define simd_store(p, v)	_mm_storeu_ps(p, v)
+#define simd_gather(a, id)	_mm_set_ps((a)[(id)[3]], (a)[(id)[2]], (a)[(id)[1]], (a)[(id)[0]])
+#define simd_set1(x)		_mm_set1_ps(x)
+#define simd_add(a, b)		_mm_add_ps(a, b)
+#define simd_sub(a, b)		_mm_sub_ps(a, b)
+#define simd_mul(a, b)		_mm_mul_ps(a, b)
+#define simd_div(a, b)		_mm_div_ps(a, b)
+#define simd_ge(a, b)		_mm_cmpge_ps(a, b)
+#define simd_gt(a, b)		_mm_cmpgt_ps(a, b)
+#define simd_and(a, b)		_mm_and_ps(a, b)
+#define simd_mask(a)		_mm_movemask_ps(a)
+#else
+#define SIMD_LANES	1
+typedef float simd_f;
+#define simd_load(p)		(*(p))
+#define simd_store(p, v)	(*(p) = (v))
+#define simd_gather(a, id)	((a)[*(id)])
+#define simd_set1(x)		(x)
+#define simd_add(a, b)		((a) + (b))
+#define simd_sub(a, b)		((a) - (b))
+#define simd_mul(a, b)		((a) * (b))
+#define simd_div(a, b)		((a) / (b))
+#define simd_ge(a, b)		((a) >= (b) ? 1.0f : 0.0f)
+#define simd_gt(a, b)		((a) > (b) ? 1.0f : 0.0f)
+#define simd_and(a, b)		((a) * (b))
+#define simd_mask(a)		((a) != 0)
+#endif
+
+/* tetra_coord() for DITH_BATCH points p[] against the tetras id[], 
+   restricted to the inside case: returns the mask of the points strictly 
+   inside, their weights being in w[]. The operations are the same as 
+   tetra_coord(), so are the results. */
+PRIVATE int tetra_inside_batch(const int32_t *id, const float (*p)[DITH_BATCH],
+                               float (*w)[DITH_BATCH]) {
+	const simd_f eps = simd_set1(DITH_EPS), zero = simd_set1(0.0f);
+	int l, k, mask = 0;
+	
+	for(l = 0; l < DITH_BATCH; l += SIMD_LANES) {
+		const int32_t *i = id + l;
+		simd_f v[4], tot, ok;
+		
+		for(k = 0; k < 4; ++k) {
+			simd_f qx = simd_sub(simd_load(&p[0][l]), simd_gather(tetra_soa.o[k][0], i));
+			simd_f qy = simd_sub(simd_load(&p[1][l]), simd_gather(tetra_soa.o[k][1], i));
+			simd_f qz = simd_sub(simd_load(&p[2][l]), simd_gather(tetra_soa.o[k][2], i));
+			v[k] = simd_add(simd_add(
+				simd_mul(qx, simd_gather(tetra_soa.n[k][0], i)),
+				simd_mul(qy, simd_gather(tetra_soa.n[k][1], i))),
+				simd_mul(qz, simd_gather(tetra_soa.n[k][2], i)));
+		}
+		
+		ok  = simd_and(simd_and(simd_ge(v[0], zero), simd_ge(v[1], zero)),
+		               simd_and(simd_ge(v[2], zero), simd_ge(v[3], zero)));
+		tot = simd_div(simd_set1(1.0f), 
+		      simd_add(simd_add(simd_add(v[0], v[1]), v[2]), v[3]));
+		for(k = 0; k < 4; ++k) {
+			v[k] = simd_mul(v[k], tot);
+			ok   = simd_and(ok, simd_gt(v[k], eps));
+			simd_store(&w[k][l], v[k]);
+		}
+		mask |= simd_mask(ok) << l;
+	}
 	
-	if(key == 0) return 7; // let black be black in space of cache reduing colors
+	return mask;
+}
 
-	cache = use_cache ? hmgetp_null(dith_cache, key) : NULL;
+PRIVATE void tetra_soa_init(worker *wk) {
+	int i, j, k;
+	for(i = 0; i < length_of(wk->tetras); ++i) {
+		tetra *t = &wk->tetras[i];
+		if(t->p[0] == NULL) continue;
+		for(j = 0; j < 3; ++j) {
+			tetra_soa.o[0][j][i] = t->p[1]->pt[j];
+			tetra_soa.n[0][j][i] = t->n132[j];
+			tetra_soa.n[1][j][i] = t->n023[j];
+			tetra_soa.n[2][j][i] = t->n031[j];
+			tetra_soa.n[3][j][i] = t->n012[j];
+			for(k = 1; k < 4; ++k) tetra_soa.o[k][j][i] = t->p[0]->pt[j];
+		}
+	}
+}
+#endif
+
+/* dith_find_tetra() for n points. The points are tested DITH_BATCH at a
+   time against the candidates of their grid cell, the ones inside none 
+   of them going through dith_find_tetra(). */
+PRIVATE void dith_find_batch(worker *wk, const int n, vec3 **p, struct tetra_hit *hit) {
+	int b, l, k;
 	
-	if(dith->max > length_of(cache->value)) {
+	for(b = 0; b < n; b += DITH_BATCH) {
+		const int m = n-b < DITH_BATCH ? n-b : DITH_BATCH;
+		int left = (1<<m) - 1;
+#if TETRA_GRID
+		const struct tetra_cell *c[DITH_BATCH];
+		float x[3][DITH_BATCH], w[4][DITH_BATCH];
+		int32_t id[DITH_BATCH];
+		int r;
+		
+		for(l = 0; l < DITH_BATCH; ++l) {
+			for(k = 0; k < 3; ++k) x[k][l] = l < m ? (*p[b+l])[k] : 0;
+			c[l] = l < m ? &tetra_cell[tetra_grid_cell(p[b+l])] : NULL;
+		}
+		
+		for(r = 0; left; ++r) {
+			int active = 0, mask;
+			
+			for(l = 0; l < DITH_BATCH; ++l) {
+				id[l] = 0;
+				if((left>>l & 1) && r < c[l]->count) {
+					id[l] = tetra_cand[c[l]->first + r];
+					active |= 1<<l;
+					STAT(&wk->stats, tetra_tested, 1);
+				}
+			}
+			if(!active) break;
+			
+			mask  = tetra_inside_batch(id, x, w) & active;
+			left &= ~mask;
+			for(l = 0; mask; ++l, mask >>= 1) if(mask & 1) {
+				hit[b+l].t = &wk->tetras[id[l]];
+				for(k = 0; k < 4; ++k) hit[b+l].w[k] = w[k][l];
+				STAT(&wk->stats, tetra_miss, 1);
+			}
+		}
+#endif
+		for(l = 0; left; ++l, left >>= 1) if(left & 1) {
+			tetra *t = dith_find_tetra(wk, p[b+l]);
+			hit[b+l].t = t;
+			for(k = 0; k < 4; ++k) hit[b+l].w[k] = t->p[k]->weight;
+		}
+	}
+}
+
+/* scale down matrices with more levels than the cache can hold. This
+   modifies the descriptor, so it must be done before any thread starts */
+PRIVATE void dith_rescale(struct dith_descriptor *dith) {
+	if(dith->max > DITH_MAX) {
 		int max = dith->max, i;
-		*(uint8_t*)&dith->max = length_of(cache->value);
 		uint8_t *p = dith->value;
+		dith->max = DITH_MAX;
 		for(i = dith->mx*dith->my; --i>=0;)
 			p[i] = (p[i]*dith->max*2 + max)/(2*max);
 	}
-	
-	assert(dith->max <= length_of(cache->value));
+}
 
-	if(cache == NULL) {
-		tetra *t = dith_find_tetra(p);
-		color *sel[4] = {t->p[0], t->p[1], t->p[2], t->p[3]},
-		      *tab[length_of(cache->value)];
-		      	
-		qsort(sel, 4, sizeof(sel[0]), color_cmp_by_weight);
-		// printf("%g %g %g %g\n", sel[0]->weight,sel[1]->weight,sel[2]->weight,sel[3]->weight);
-		// printf("%d %d %d %d\n", sel[0]->index,sel[1]->index,sel[2]->index,sel[3]->index);
-		// vec3 <q; 
-		// tetra_coord(t, p, &q);
-		// printf("%g %g %g\n", (*p)[0], (*p)[1], (*p)[2]);
-		// printf("%g %g %g\n", q[0], q[1], q[2]);
-		// vec3_sub(&q,&q,p);
-		// printf("%g\n", vec3_dot(&q,&q));
-		
-		do {
-			int i = 0; float m = 0; //0.5f;			
-			m += sel[0]->weight * dith->max; while(i<m) tab[i++] = sel[0];
-			m += sel[1]->weight * dith->max; while(i<m) tab[i++] = sel[1];
-			m += sel[2]->weight * dith->max; while(i<m) tab[i++] = sel[2];
-			while(i<dith->max) tab[i++] = sel[3];
-		} while(0);
-		
-		qsort(tab, dith->max, sizeof(tab[0]), color_cmp_by_intens);
-		
-		do {
-			struct dith_cache new_entry; int i;
-			new_entry.key = key;
-			for(i=0; i<dith->max; ++i) new_entry.value[i] = tab[i]->index;
-			hmputs(dith_cache, new_entry);
-		} while(0);
-		
-		
-		cache = hmgetp_null(dith_cache, key);
-		assert(cache != NULL);
+PRIVATE const uint16_t tetras_desc[] = {
+#if HALF_INTENSITY==187
+	0x0518, 0x0458, 0x0248, 0x4268, 
+	0x0328, 0x0138, 0x1389, 0x5189, 
+	0x682A, 0x328A, 0x3A8B, 0x8A7B, 
+	0x879B, 0x389B, 0x584C, 0x486C, 
+	0x87CD, 0x58CD, 0x897D, 0x598D, 
+	0x78CE, 0x6C8E, 0x68AE, 0x7A8E
+#elif HALF_INTENSITY==157
+	0x4268, 0x0328, 0x0138, 0x5048, 
+	0x0248, 0x5108, 0x1389, 0x5189, 
+	0x283A, 0x268A, 0x879B, 0x389B, 
+	0x8A7B, 0x3A8B, 0x486C, 0x584C, 
+	0x58CD, 0x598D, 0x789D, 0x7C8D, 
+	0x86CE, 0x7A8E, 0x8A6E, 0x78CE
+#else
+	// 0x0138, 0x0248, 0x4268, 0x0518, 
+	// 0x0458, 0x0328, 0x1389, 0x1859, 
+	// 0x283A, 0x268A, 0x78AB, 0x798B, 
+	// 0x389B, 0x3A8B, 0x486C, 0x458C, 
+	// 0x859D, 0x789D, 0x7C8D, 0x8C5D, 
+	// 0x8A6E, 0x7A8E, 0x78CE, 0x86CE
+	// 0x2648, 0x0328, 0x1058, 0x0248, 0x0458, 0x1308, 0x1389, 0x1859, 0x328A, 0x268A, 0x78AB, 0x798B, 0x389B, 0x3A8B, 0x486C, 0x458C, 0x789D, 0x859D, 0x7C8D, 0x8C5D, 0x68AE, 0x7A8E, 0x78CE, 0x6C8E
+	// 0x1048, 0x2138, 0x2608, 0x0648, 0x1458, 0x2018, 0x1859, 0x1389, 0x268A, 0x283A, 0x3A8B, 0x78AB, 0x389B, 0x798B, 0x584C, 0x486C, 0x8C5D, 0x859D, 0x7C8D, 0x789D, 0x86CE, 0x8A6E, 0x78CE, 0x7A8E
+	// 0x0268, 0x5108, 0x0648, 0x1208, 0x1328, 0x5048, 0x1389, 0x1859, 0x283A, 0x268A, 0x879B, 0x389B, 0x8A7B, 0x3A8B, 0x486C, 0x458C, 0x897D, 0x598D, 0x87CD, 0x58CD, 0x7A8E, 0x6C8E, 0x78CE, 0x68AE
+	// 0x0138, 0x0328, 0x4518, 0x6408, 0x0418, 0x6028, 0x5189, 0x1389, 0x832A, 0x826A, 0x389B, 0x78AB, 0x3A8B, 0x798B, 0x648C, 0x584C, 0x58CD, 0x789D, 0x598D, 0x7C8D, 0x8C7E, 0x6C8E, 0x68AE, 0x87AE
+	// 0x6428, 0x0458, 0x3208, 0x3018, 0x0518, 0x0248, 0x1859, 0x3819, 0x283A, 0x682A, 0x3A8B, 0x78AB, 0x389B, 0x798B, 0x458C, 0x486C, 0x598D, 0x58CD, 0x7C8D, 0x789D, 0x68AE, 0x6C8E, 0x78CE, 0x7A8E
+	0x0128, 0x0518, 0x0268, 0x0648, 
+	0x1328, 0x0458, 0x1389, 0x1859, 
+	0x328A, 0x826A, 0x3A8B, 0x78AB, 
+	0x389B, 0x798B, 0x458C, 0x648C, 
+	0x789D, 0x58CD, 0x598D, 0x7C8D, 
+	0x86CE, 0x78CE, 0x7A8E, 0x8A6E
+#endif
+};
 
-		// for(int i=0;i<64;++i) printf("%d ", cache->value[i]);
-		// printf("\n");
-		// exit(0);
-	}
-	else dith_hit += 1; 
-	dith_total += 1;
+/* Persistent cache of the tetra solutions (--cache-file). A record holds
+   the colors of the tetra and their weights at the center of the cell of
+   its key, which depends neither on the dither matrix nor on the images
+   that filled the file. The file is mapped read-only when opened, the solutions 
+   found during the run being appended when closed: they are only found 
+   in the file by the next run. The header holds all that the solutions 
+   depend on, palette and gamma included, so that a stale file is not 
+   reused, and the records are checked when loaded. */
+
+#define STORE_VERSION	3
+
+struct dith_store_header {
+	char     magic[4];		/* "SQDC" */
+	uint16_t version;		/* STORE_VERSION */
+	uint16_t base;			/* DITH_BASE */
+	uint32_t intensity;		/* HALF_INTENSITY */
+	uint32_t tetras;		/* hash of tetras_desc[] */
+	uint32_t palette;		/* hash of the linear palette (gamma) */
+};
 
-	return cache->value[dith->value[(y % dith->my)*dith->mx + (x % dith->mx)]-1];
-}
+struct dith_store_rec {
+	uint32_t key;
+	uint8_t  color[4];		/* palette index, in tetra order */
+	float    weight[4];
+};
 
-PRIVATE struct dith_descriptor *dith_find(char *name) {
-	int i;
-	for(i=0; dith_descriptors[i].name;++i) {
-		if(!strcmp(dith_descriptors[i].name, name)) {
-			return &dith_descriptors[i];
-		}
+PRIVATE struct {
+	const char *path;
+	struct dith_store_header header;
+	const struct dith_store_rec *rec;
+	void    *map;
+	size_t   map_size;
+	uint32_t *index;		/* key -> 1 + record, 0 if none */
+	int      loaded, saved;
+	struct dith_store_rec *added;
+	pthread_mutex_t lock;
+} dith_store = {NULL};
+
+PRIVATE void dith_store_save(void);
+
+PRIVATE void dith_store_header(struct dith_store_header *h) {
+	uint32_t hash = 2166136261u, pal = 2166136261u;
+	int i, j;
+	
+	for(i = 0; i < length_of(tetras_desc); ++i) 
+		hash = (hash ^ tetras_desc[i]) * 16777619u;
+	for(i = 0; i < length_of(main_worker.palette); ++i)
+	for(j = 0; j < 3; ++j) {
+		uint32_t x;
+		memcpy(&x, &main_worker.palette[i].pt[j], sizeof(x));
+		pal = (pal ^ x) * 16777619u;
 	}
-	return NULL;
+	
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, "SQDC", 4);
+	h->version   = STORE_VERSION;
+	h->base      = DITH_BASE;
+	h->intensity = HALF_INTENSITY;
+	h->tetras    = hash;
+	h->palette   = pal;
 }
 
-typedef struct {
-	int w;
-	int h;
-	uint8_t *sRGB;
-	uint8_t bitmap[65536];
-	struct timeval time;
-	int saved_size;
-	float norm_0, norm_1;
-} pic;
+/* a record of a foreign or damaged file must not index out of the 
+   palette */
+PRIVATE int dith_store_valid(const struct dith_store_rec *rec) {
+	int i;
+	for(i = 0; i < 4; ++i) 
+		if(rec->color[i] >= length_of(main_worker.palette)
+		|| !(rec->weight[i] >= 0.0f && rec->weight[i] <= 1.0f)) return FALSE;
+	return TRUE;
+}
 
-PRIVATE float pic_done(pic *pic) {
-	struct timeval now;
-	float secs = 0;
+PRIVATE void dith_store_open(const char *path) {
+	const size_t len = DITH_BASE*DITH_BASE*DITH_BASE;
+	struct stat st;
+	int fd, i, bad;
 	
-	if(pic->sRGB) {
-		free(pic->sRGB);
-		pic->sRGB = NULL;
+	dith_store.path  = path;
+	dith_store.index = calloc(len, sizeof(*dith_store.index));
+	if(!dith_store.index) OUT_OF_MEM((int)(len*sizeof(*dith_store.index)));
+	pthread_mutex_init(&dith_store.lock, NULL);
+	dith_store_header(&dith_store.header);
 	
-		gettimeofday(&now, NULL);
-		if(now.tv_usec<pic->time.tv_usec) {
-			now.tv_usec += 1000000;
-			now.tv_sec--;
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return; /* created when saved */
+	
+	if(fstat(fd, &st) == 0 && st.st_size >= sizeof(dith_store.header)) {
+		dith_store.map_size = st.st_size;
+#ifdef _WIN32
+		dith_store.map = malloc(st.st_size);
+		if(dith_store.map && read(fd, dith_store.map, st.st_size) != st.st_size) {
+			free(dith_store.map);
+			dith_store.map = NULL;
 		}
-		pic->time.tv_sec  = now.tv_sec  - pic->time.tv_sec;
-		pic->time.tv_usec = now.tv_usec - pic->time.tv_usec;
-		secs = pic->time.tv_sec + pic->time.tv_usec/1000000.0f;
+#else
+		dith_store.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(dith_store.map == MAP_FAILED) dith_store.map = NULL;
+#endif
 	}
-		
-	if(verbose) {
-		if(secs<0.0001) printf("done (%.1fus", secs*1000000.0f);
-		else if(secs<1) printf("done (%.1fms", secs*1000.0f);
-		else            printf("done (%.1fs",  secs);
-		if(pic->saved_size>0) printf(", %d bytes", pic->saved_size);
-		printf(")\n");
+	close(fd);
+	
+	if(dith_store.map == NULL
+	|| memcmp(dith_store.map, &dith_store.header, sizeof(dith_store.header))) {
+		FATAL("Stale cache file: %s", path, 0);
+		return;
 	}
 	
-	return secs;
+	dith_store.rec    = (void*)((char*)dith_store.map + sizeof(dith_store.header));
+	dith_store.loaded = (st.st_size - sizeof(dith_store.header)) / sizeof(*dith_store.rec);
+	for(i = bad = 0; i < dith_store.loaded; ++i) {
+		uint32_t key = dith_store.rec[i].key;
+		if(!dith_store_valid(&dith_store.rec[i])) ++bad;
+		else if(key < len && !dith_store.index[key]) dith_store.index[key] = i + 1;
+	}
+	if(bad) fprintf(stderr, "%s: %d corrupted entries ignored\n", path, bad);
 }
 
-PRIVATE const char *basename(const char *s) {
-	const char *t = s;
-	while(*t) ++t;
-	while(t>s && t[-1]!='/' && t[-1]!='\\') --t;
-	return t;
+PRIVATE void dith_store_close(const uint8_t verbose) {
+	if(dith_store.index == NULL) return;
+	
+	dith_store_save();
+	
+	if(verbose>1) printf("%s: %d entries loaded, %d added\n", 
+		dith_store.path, dith_store.loaded, dith_store.saved);
+	
+#ifdef _WIN32
+	free(dith_store.map);
+#else
+	if(dith_store.map) munmap(dith_store.map, dith_store.map_size);
+#endif
+	free(dith_store.index);
+	arrfree(dith_store.added);
+	pthread_mutex_destroy(&dith_store.lock);
+	memset(&dith_store, 0, sizeof(dith_store));
 }
 
-PRIVATE void squale_coord(pic *pic, int x, int y, int *rx, int *ry) {
-	const int w = pic->w, h = pic->h;
-	float fx, fy, k = aspect_ratio;
-	if(w<=h*k) {
-		fx = (x*h*k)/256  + (centered ? 0.5f*(w - h*k) : 0);
-		fy = (y*h)/256;
-	} else {
-		fx = (x*w)/256;
-		fy = (y*w/k)/256 + (centered ? 0.5f*(h - w/k) : 0);
+/* writes a new file with the header and the new solutions under a
+   temporary name, then renames it into place: the old file may be mapped
+   by other processes, which must not see it truncated */
+PRIVATE void dith_store_replace(void) {
+	const size_t hlen = sizeof(dith_store.header);
+	const size_t len = arrlen(dith_store.added) * sizeof(*dith_store.added);
+	int l = strlen(dith_store.path) + 32, ok;
+	char *tmp = malloc(l);
+	FILE *f;
+	
+	if(!tmp) OUT_OF_MEM(l);
+	snprintf(tmp, l, "%s.%d", dith_store.path, (int)getpid());
+	f = fopen(tmp, "wb");
+	if(f == NULL) {perror(tmp); free(tmp); return;}
+	ok = fwrite(&dith_store.header, 1, hlen, f) == hlen
+	  && fwrite(dith_store.added, 1, len, f) == len;
+	if(fclose(f) || !ok) perror(tmp);
+#ifdef _WIN32
+	else if(rename(tmp, dith_store.path)) {
+		remove(dith_store.path); 
+		ok = !rename(tmp, dith_store.path);
 	}
-	*rx = nearbyintf(fx);
-	*ry = nearbyintf(fy);
+#else
+	else ok = !rename(tmp, dith_store.path);
+#endif
+	if(ok) dith_store.saved += arrlen(dith_store.added);
+	remove(tmp);
+	free(tmp);
 }
 
-PRIVATE void pic_norm(pic *pic, const float bl, const float wl) {
-	float *tab = NULL, t, w, b;
-	size_t len = pic->w*pic->h;
-	int i;
-	
-	if(bl<=0 && wl<=0) return;
+/* appends the new solutions. The file is locked, so that several sqpix
+   can share it, and an incomplete record left by a crash is dropped. */
+PRIVATE void dith_store_save(void) {
+	const size_t hlen = sizeof(dith_store.header), rlen = sizeof(*dith_store.added);
+	struct dith_store_header h;
+	struct stat st;
+	size_t len;
+	int fd;
 	
-	if(verbose>1) printf("normalizing ");
+	if(arrlen(dith_store.added) == 0) return;
 
-	for(i = 3*len; (i-=3) >= 0;) {
-		float r = sRGB2lin(pic->sRGB[i+0]);
-		float g = sRGB2lin(pic->sRGB[i+1]);
-		float b = sRGB2lin(pic->sRGB[i+2]);
-		float y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
-		arrput(tab, y);
+	/* again if replaced by another process while waiting for the lock */
+	for(fd = -1; fd < 0; ) {
+		fd = open(dith_store.path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if(fd < 0) {perror(dith_store.path); return;}
+#ifndef _WIN32
+		do {
+			struct flock lck;
+			struct stat cur;
+			memset(&lck, 0, sizeof(lck));
+			lck.l_type   = F_WRLCK;
+			lck.l_whence = SEEK_SET;
+			if(fcntl(fd, F_SETLKW, &lck) < 0) perror(dith_store.path);
+			if(fstat(fd, &st) == 0 && stat(dith_store.path, &cur) == 0
+			&& (st.st_ino != cur.st_ino || st.st_dev != cur.st_dev)) {
+				close(fd); 
+				fd = -1;
+			}
+		} while(0);
+#endif
 	}
 	
-	qsort(tab, len, sizeof(tab[0]), intens_cmp);
-	
-	if(bl>=0) {
-		t = (len-1)*bl; i = floorf(t); t -= i;	
-		b = tab[i] + t*(tab[(i+1>=len)?i:i+1] - tab[i]);
-	} else	b = 0;
-	
-	if(wl>=0) {
-		t = (len-1)*wl; i = floorf(t); t -= i; 
-		w = tab[i] + t*(tab[(i+1>=len)?i:i+1] - tab[i]);
-	} else	w = 1;
-	
-	if(verbose>1) printf("%.1f%%->%.1f%%...", b*100.0f, w*100.0f);
+	len = fstat(fd, &st) == 0 ? st.st_size : 0;
+	if(len >= hlen) {
+		/* check again, another process might have rewritten it */
+		int rd = open(dith_store.path, O_RDONLY);
+		if(rd < 0 || read(rd, &h, hlen) != hlen 
+		|| memcmp(&h, &dith_store.header, hlen)) len = 0;
+		if(rd >= 0) close(rd);
+	}
+	if(len < hlen) {
+#ifdef _WIN32
+		close(fd);	/* an open file can't be replaced */
+		fd = -1;
+#endif
+		dith_store_replace();
+		if(fd >= 0) close(fd); /* releases the lock */
+		arrsetlen(dith_store.added, 0);
+		return;
+	} else if((len - hlen) % rlen) {
+		if(ftruncate(fd, len - (len - hlen) % rlen)) 
+			perror(dith_store.path);
+	}
 	
-	if(b!=0 && w!=1 && b<w) {
-		pic->norm_0 = b;
-		pic->norm_1 = sRGB2lin(255)/(w - b);
-	} else pic->norm_0 = pic->norm_1 = -1;
+	len = arrlen(dith_store.added) * rlen;
+	if(write(fd, dith_store.added, len) != len) perror(dith_store.path);
+	else dith_store.saved += arrlen(dith_store.added);
+	close(fd); /* releases the lock */
 	
-	arrfree(tab);
+	arrsetlen(dith_store.added, 0);
 }
 
-PRIVATE int pic_load(pic *pic, const char *filename) {
-	int n;
-	
-	gettimeofday(&pic->time, NULL);
-	pic->saved_size = 0;
-	pic->norm_0 = pic->norm_1 = -1;
+/* the 4 colors mixing into p, with their weight. A non-zero key allows 
+   to use the persistent cache. hit is p already located, if not NULL. */
+PRIVATE void dith_solve(worker *wk, const uint32_t key, vec3 *p, 
+                        const struct tetra_hit *hit, color *sel[4]) {
+	const uint8_t use_store = key && dith_store.index;
+	int i;
 	
-	if(!stbi_info(filename, &pic->w, &pic->h, &n)) {
-		FATAL("Unsupported image: %s", filename, 0);
-		return FALSE;
+	if(use_store && dith_store.index[key]) {
+		const struct dith_store_rec *rec = &dith_store.rec[dith_store.index[key]-1];
+		for(i = 0; i < 4; ++i) {
+			sel[i] = &wk->palette[rec->color[i]];
+			sel[i]->weight = rec->weight[i];
+		}
+	} else {
+		tetra *t = hit ? hit->t : dith_find_tetra(wk, p);
+		for(i = 0; i < 4; ++i) {
+			sel[i] = t->p[i];
+			if(hit) sel[i]->weight = hit->w[i];
+		}
+		
+		if(use_store) {
+			struct dith_store_rec rec;
+			rec.key = key;
+			for(i = 0; i < 4; ++i) {
+				rec.color[i]  = sel[i]->index;
+				rec.weight[i] = sel[i]->weight;
+			}
+			pthread_mutex_lock(&dith_store.lock);
+			arrput(dith_store.added, rec);
+			if(arrlen(dith_store.added) >= 65536) dith_store_save();
+			pthread_mutex_unlock(&dith_store.lock);
+		}
 	}
+}
+
+/* fills value[] with the dith->max colors mixing into p, sorted by
+   intensity. key is the cache key, p being then dith_center(key), or 0 
+   when not caching. */
+PRIVATE void dith_ramp(worker *wk, const struct dith_descriptor *dith, 
+                       const uint32_t key, vec3 *p, const struct tetra_hit *hit,
+                       uint8_t *value) {
+	color *sel[4];
+	uint8_t o[4];
+	int n[4], i;
 	
-	if(verbose) {	
-		printf("%s (%dx%d)...", basename(filename), pic->w, pic->h);
-		fflush(stdout);
-	}
+	assert(dith->max <= DITH_MAX);
 	
-	pic->sRGB = stbi_load(filename, &pic->w, &pic->h, &n, 3);
+	dith_solve(wk, key, p, hit, sel);
 	
-	if(pic->sRGB == NULL)  {
-		FATAL("Error while loading: %s", filename, 0);
-		return FALSE;
+	/* 5-comparator sorting network on o[], the ties being ordered by 
+	   position so that the result is the one of a stable sort */
+#define RAMP_SORT(before) do {						\
+	o[0] = 0; o[1] = 1; o[2] = 2; o[3] = 3;				\
+	RAMP_CSWAP(before, 0, 1); RAMP_CSWAP(before, 2, 3);		\
+	RAMP_CSWAP(before, 0, 2); RAMP_CSWAP(before, 1, 3);		\
+	RAMP_CSWAP(before, 1, 2);					\
+	} while(0)
+#define RAMP_CSWAP(before, a, b) 					\
+	if(before(o[b], o[a]) || (!before(o[a], o[b]) && o[b] < o[a])) {\
+		uint8_t t = o[a]; o[a] = o[b]; o[b] = t;		\
 	}
+#define BY_WEIGHT(a, b)	(sel[a]->weight > sel[b]->weight)
+#define BY_INTENS(a, b)	(sel[a]->intens < sel[b]->intens)
+
+	/* by decreasing weight */
+	RAMP_SORT(BY_WEIGHT);
+	do {	color *s[4] = {sel[o[0]], sel[o[1]], sel[o[2]], sel[o[3]]};
+		memcpy(sel, s, sizeof(s));
+	} while(0);
 	
-#ifdef STBIR_INCLUDE_STB_IMAGE_RESIZE2_H
-	if(hq_zoom) {
-		int w = pic->w, h = pic->h;
-		
-		if(h>w*aspect_ratio) {
-			w = (w*256)/h;
-			h = 256;
-		} else {
-			h = (h*256)/w;
-			w = 256;
+	/* number of levels of each color */
+	do {
+		float m = 0; //0.5f;
+		int j;
+		for(i = j = 0; j < 3; ++j) {
+			int k = i;
+			m += sel[j]->weight * dith->max; while(i<m) ++i;
+			n[j] = (i < dith->max ? i : dith->max) - (k < dith->max ? k : dith->max);
 		}
+		n[3] = i < dith->max ? dith->max - i : 0;
+	} while(0);
+	
+	/* by increasing intensity */
+	RAMP_SORT(BY_INTENS);
+	for(i = 0; i < 4; ++i) {
+		memset(value, sel[o[i]]->index, n[o[i]]);
+		value += n[o[i]];
+	}
+#undef BY_INTENS
+#undef BY_WEIGHT
+#undef RAMP_CSWAP
+#undef RAMP_SORT
+}
 
-		if(w!=pic->w || h!=pic->h) {
-			uint8_t *buf = stbir_resize_uint8_srgb(
-				pic->sRGB, pic->w, pic->h,0,
-				NULL,w,h,0, STBIR_RGB);
-			if(buf) {
-				free(pic->sRGB);
-				pic->sRGB = buf;
-				pic->w = w;
-				pic->h = h;
-			} 
-		}
+/* run-length encodes a ramp built by dith_ramp() */
+PRIVATE void dith_lut_set(struct dith_lut *lut, const uint8_t *value, int max) {
+	int i, n = 0;
+	
+	lut->color[0] = value[0];
+	lut->limit[0] = lut->limit[1] = lut->limit[2] = 255;
+	for(i = 1; i < max; ++i) if(value[i] != value[i-1]) {
+		assert(n < 3);
+		lut->limit[n++]  = i;
+		lut->color[n]    = value[i];
 	}
-#endif
-	return TRUE;
+	while(n < 3) {++n; lut->color[n] = lut->color[n-1];}
+	lut->valid = TRUE;
 }
 
-PRIVATE uint32_t pic_crc32(pic *pic) {
-	#define CRC32_POLY 0x04C11DB7
-	uint32_t crc = ~0; int i, j;
-	for(i = pic->w*pic->h*3; --i>=0;) {
-		crc ^= ((uint32_t)pic->sRGB[i]) << 24; 
-		for (j = 0; j < 8; ++j) {
-			int32_t msb = crc & 0x80000000;	
-			crc <<= 1;
-			if(msb) crc ^= CRC32_POLY;
-		}
-        }
-	return ~crc;
+PRIVATE uint8_t dith_lut_get(const struct dith_lut *lut, int v) {
+	return lut->color[(v>=lut->limit[0]) + (v>=lut->limit[1]) + (v>=lut->limit[2])];
 }
 
-PRIVATE void pic_save(pic *pic, const char *filename) {
-	FILE *f = fopen(filename, "wb");
-	
-	if(f==NULL) {
-		perror(filename);
-		return;
+PRIVATE struct dith_lut *worker_lut(worker *wk) {
+	if(wk->dith_lut == NULL) {
+		const size_t len = DITH_BASE*DITH_BASE*DITH_BASE;
+		wk->dith_lut = calloc(len, sizeof(*wk->dith_lut));
+		if(wk->dith_lut == NULL) OUT_OF_MEM((int)(len*sizeof(*wk->dith_lut)));
 	}
+	return wk->dith_lut;
+}
+
+/* the cache entries of p, NULL for black. They are created on misses. */
+PRIVATE const struct dith_lut *dith_lut_entry(worker *wk, 
+                     const struct dith_descriptor *dith, const uint16_t *c) {
+	const uint32_t key = dith_key(c);
+	struct dith_lut *lut;
 	
-	if(verbose>1) {
-		printf("saving %s...", basename(filename));
-		fflush(stdout);
-	}
+	if(key == 0) return NULL; // let black be black in space of cache reduing colors
 	
-	fprintf(f, zx0 ? "SQP\3" : exo ? "SQP\2" : "SQP\1");
+	lut = &worker_lut(wk)[key];
+	if(!lut->valid) {
+		uint8_t value[DITH_MAX];
+		vec3 p;
+		dith_ramp(wk, dith, key, dith_center(key, &p), NULL, value);
+		dith_lut_set(lut, value, dith->max);
+		++wk->dith_lut_len;
+	} else STAT(&wk->stats, dith_hit, 1);
+	STAT(&wk->stats, dith_total, 1);
 	
-	if(zx0) {
-		size_t nOriginalSize = 65536, 
-		       nCompressedSize = 0, 
-		       nMaxWindowSize = 0,
-		       nMaxCompressedSize;
-                int nFlags = 0;
-		
-		uint8_t *in, *out;
-		int i;
-		
-		in = malloc(nOriginalSize);
-		if(!in) OUT_OF_MEM(nOriginalSize);
-		
-		nMaxCompressedSize = salvador_get_max_compressed_size(nOriginalSize);
-		out = malloc(nMaxCompressedSize);
-		if(!out) OUT_OF_MEM(nMaxCompressedSize);
+	return lut;
+}
+
+PRIVATE const uint8_t *dith_cache_entry(worker *wk, 
+                     const struct dith_descriptor *dith, 
+                     const uint8_t use_cache, const uint16_t *c) {
+	const uint32_t key = use_cache ? dith_key(c) : 1; 
+	struct dith_cache *cache;
+	
+	if(key == 0) return NULL; // let black be black in space of cache reduing colors
 
-		for(i=0; i<nOriginalSize; ++i) in[i] = pic->bitmap[i ^ 0x00FF];
+	cache = use_cache ? hmgetp_null(wk->dith_cache, key) : NULL;
+	
+	if(cache == NULL) {
+		struct dith_cache new_entry;
+		vec3 p;
+		new_entry.key = key;
+		dith_ramp(wk, dith, use_cache ? key : 0, 
+			use_cache ? dith_center(key, &p) : rgb16_vec3(c, &p), NULL, new_entry.value);
+		hmputs(wk->dith_cache, new_entry);
 		
-		memset(out, 0, nMaxCompressedSize);
-		nCompressedSize = salvador_compress(in, out, nOriginalSize, nMaxCompressedSize, nFlags, nMaxWindowSize, 0, NULL, NULL);
-		 
-		if(nCompressedSize==(size_t)-1)
-		FATAL("Failed to compress %s", filename, -1);	
-		free(in);
+		cache = hmgetp_null(wk->dith_cache, key);
+		assert(cache != NULL);
 
-		fwrite(out, 1, nCompressedSize, f);
-		free(out);
-	} else if(exo) {
-		struct membuf inbuf[1];
-		struct membuf outbuf[1];
-		struct crunch_info info[1];
-		static struct crunch_options options[1] = { CRUNCH_OPTIONS_DEFAULT };
-		int i = 65536;
+		// for(int i=0;i<64;++i) printf("%d ", cache->value[i]);
+		// printf("\n");
+		// exit(0);
+	}
+	else STAT(&wk->stats, dith_hit, 1); 
+	STAT(&wk->stats, dith_total, 1);
+
+	return cache->value;
+}
+
+PRIVATE uint8_t dith(worker *wk, const struct dith_descriptor *dith, 
+                     const uint8_t use_cache, 
+                     const int x, const int y, const uint16_t *c) {
+	const int v = dith->value[(y % dith->my)*dith->mx + (x % dith->mx)]-1;
+	
+	if(use_cache == CACHE_LUT) {
+		const struct dith_lut *lut = dith_lut_entry(wk, dith, c);
+		return lut ? dith_lut_get(lut, v) : 7;
+	} else {
+		const uint8_t *value = dith_cache_entry(wk, dith, use_cache, c);
+		return value ? value[v] : 7;
+	}
+}
+
+/* empties the caches */
+PRIVATE void worker_flush(worker *wk) {
+	hmfree(wk->dith_cache);
+	free(wk->dith_lut);
+	wk->dith_lut = NULL;
+	wk->dith_lut_len = 0;
+}
+
+PRIVATE int worker_cache_len(worker *wk) {
+	return hmlen(wk->dith_cache) + wk->dith_lut_len;
+}
+
+/* (re)starts a worker from scratch: empty cache, initial LRU order */
+PRIVATE void worker_init(worker *wk) {
+	int i;
+	
+	worker_flush(wk);
+	memset(&wk->stats, 0, sizeof(wk->stats));
+	wk->tetra_list = NULL;
+	
+	for(i=0; i<15; ++i) {
+		float c = sRGB2lin(i>=8 ? HALF_INTENSITY : FULL_INTENSITY);
+		set_palette(wk, i, i&4 ? 0.0f : c,
+		                   i&2 ? 0.0f : c,
+			           i&1 ? 0.0f : c);
+	}
+
+	for(i=0; i<length_of(tetras_desc); ++i) {
+		uint16_t x = tetras_desc[i];
+		new_tetra(wk, &wk->tetras[i], 
+			  x>>12,(x>>8)&15,
+			  (x>>4)&15,x&15);
+	}
+}
+
+PRIVATE struct dith_descriptor *dith_find(char *name) {
+	int i;
+	for(i=0; dith_descriptors[i].name;++i) {
+		if(!strcmp(dith_descriptors[i].name, name)) {
+			return &dith_descriptors[i];
+		}
+	}
+	return NULL;
+}
+
+/* Row by row reader of the uncompressed formats (PPM, PGM, PAM and BMP),
+   so that big images don't have to be loaded at once. */
+typedef struct pic_stream {
+	FILE *f;
+	int w, h;
+	int depth;		/* bytes per pixel */
+	int stride;		/* bytes per row */
+	uint8_t bgr;		/* BMP: blue first, rows from the bottom */
+	uint8_t *raw;
+	int next;
+} pic_stream;
+
+PRIVATE int stream_int(FILE *f) {
+	int c, n = 0;
+	
+	do {	c = getc(f);
+		if(c == '#') while(c != '\n' && c != EOF) c = getc(f);
+	} while(c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	if(c < '0' || c > '9') return -1;
+	while(c >= '0' && c <= '9' && n < 1<<24) {n = n*10 + c - '0'; c = getc(f);}
+	return n; /* eats the whitespace following the number */
+}
+
+PRIVATE uint32_t stream_le(const uint8_t *p, int n) {
+	uint32_t v = 0;
+	while(--n >= 0) v = (v<<8) | p[n];
+	return v;
+}
+
+/* opens filename if it is in a format that can be streamed, with a 
+   maximum value of 255 */
+PRIVATE pic_stream *pic_stream_open(const char *filename) {
+	pic_stream s;
+	uint8_t hd[54];
+	
+	memset(&s, 0, sizeof(s));
+	s.f = fopen(filename, "rb");
+	if(s.f == NULL || fread(hd, 1, 2, s.f) != 2) goto fail;
+	
+	if(hd[0]=='P' && (hd[1]=='5' || hd[1]=='6')) {
+		s.depth = hd[1]=='5' ? 1 : 3;
+		s.w = stream_int(s.f);
+		s.h = stream_int(s.f);
+		if(stream_int(s.f) != 255) goto fail;
+	} else if(hd[0]=='P' && hd[1]=='7') {
+		char line[80], key[16];
+		int v, max = -1;
+		while(fgets(line, sizeof(line), s.f) && strncmp(line, "ENDHDR", 6)) {
+			if(sscanf(line, "%15s %d", key, &v) != 2) continue;
+			if(!strcmp(key, "WIDTH"))  s.w = v;
+			if(!strcmp(key, "HEIGHT")) s.h = v;
+			if(!strcmp(key, "DEPTH"))  s.depth = v;
+			if(!strcmp(key, "MAXVAL")) max = v;
+		}
+		if(max != 255 || s.depth < 1 || s.depth > 4) goto fail;
+	} else if(hd[0]=='B' && hd[1]=='M') {
+		int32_t h;
+		if(fread(hd+2, 1, sizeof(hd)-2, s.f) != sizeof(hd)-2
+		|| stream_le(hd+14, 4) < 40			/* BITMAPINFOHEADER */
+		|| stream_le(hd+30, 4) != 0			/* BI_RGB */
+		|| (stream_le(hd+28, 2) != 24 && stream_le(hd+28, 2) != 32))
+			goto fail;
+		s.w     = stream_le(hd+18, 4);
+		h       = stream_le(hd+22, 4);
+		s.h     = h<0 ? -h : h;
+		s.depth = stream_le(hd+28, 2)/8;
+		s.bgr   = h<0 ? 1 : 2; /* 2 = bottom-up */
+		if(fseek(s.f, stream_le(hd+10, 4), SEEK_SET)) goto fail;
+	} else goto fail;
+	
+	if(s.w <= 0 || s.h <= 0 || s.w > 1<<16) goto fail;
+	s.stride = s.w*s.depth;
+	if(s.bgr) s.stride = (s.stride + 3) & ~3;
+	s.raw = malloc(s.stride);
+	if(s.raw) {
+		pic_stream *ret = malloc(sizeof(s));
+		if(ret) {memcpy(ret, &s, sizeof(s)); return ret;}
+		free(s.raw);
+	}
+	
+fail:	if(s.f) fclose(s.f);
+	return NULL;
+}
+
+PRIVATE void pic_stream_close(pic_stream *s) {
+	if(s == NULL) return;
+	fclose(s->f);
+	free(s->raw);
+	free(s);
+}
+
+/* reads the next row in rgb[], returns its number, -1 if truncated */
+PRIVATE int pic_stream_row(pic_stream *s, uint8_t *rgb) {
+	const uint8_t *p = s->raw;
+	int i;
+	
+	if(s->next >= s->h || fread(s->raw, 1, s->stride, s->f) != s->stride) return -1;
+	
+	for(i = 0; i < s->w; ++i, p += s->depth, rgb += 3) {
+		if(s->bgr) {
+			rgb[0] = p[2]; rgb[1] = p[1]; rgb[2] = p[0];
+		} else if(s->depth < 3) {
+			rgb[0] = rgb[1] = rgb[2] = p[0]; /* gray */
+		} else {
+			rgb[0] = p[0]; rgb[1] = p[1]; rgb[2] = p[2];
+		}
+	}
+	
+	i = s->next++;
+	return s->bgr == 2 ? s->h-1 - i : i;
+}
+
+typedef struct {
+	int w;
+	int h;
+	const char *name;
+	pic_stream *stream;		/* source, when not loaded */
+	uint8_t *sRGB;
+	uint16_t *lin;			/* 16 bits linear source if resized */
+	uint16_t (*plane)[3];		/* linear color of each squale pixel */
+	uint8_t bitmap[65536];
+	struct timeval time;
+	int saved_size;
+	float norm_0, norm_1;
+	uint32_t norm_0x, norm_1x;	/* norm_0 and norm_1 in 16.16 */
+	int box_x[2][256], box_y[2][256]; /* source area of a squale pixel */
+	uint32_t crc;
+	uint64_t src_crc;		/* of the input file, for --incremental */
+	uint8_t replace;		/* output is from the same input */
+	int format_size[4];		/* raw, exo, zx0, span SQP sizes with --best */
+	double format_time[4];		/* and display times, --target-time */
+	double stage_time[STAGES];	/* seconds spent in each stage */
+	stats stats;			/* of the conversion, for --stats */
+	const uint8_t *src;		/* image in memory, NULL to read the file */
+	int src_len;			/* encoded, */
+	int src_w, src_h;		/* or RGB when src_w > 0 */
+	struct membuf sqp;
+	const options *opt;
+	worker *wk;
+} pic;
+
+PRIVATE const char *stage_names[STAGES] = {
+	"load", "resize", "norm", "dither", "compress", "write"
+};
+
+/* monotonic clock for the stage timings */
+PRIVATE double mono_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+/* adds the time elapsed since t to the stage, returning the current time */
+PRIVATE double pic_stage(pic *pic, const int stage, const double t) {
+	const double now = mono_time();
+	pic->stage_time[stage] += now - t;
+	return now;
+}
+
+PRIVATE float pic_done(pic *pic) {
+	struct timeval now;
+	float secs = 0;
+	int i;
+	
+	pic_stream_close(pic->stream); pic->stream = NULL;
+	free(pic->sRGB); pic->sRGB  = NULL;
+	free(pic->lin);  pic->lin   = NULL;
+	free(pic->plane);pic->plane = NULL;
+	membuf_free(&pic->sqp);
+	
+	gettimeofday(&now, NULL);
+	if(now.tv_usec<pic->time.tv_usec) {
+		now.tv_usec += 1000000;
+		now.tv_sec--;
+	}
+	pic->time.tv_sec  = now.tv_sec  - pic->time.tv_sec;
+	pic->time.tv_usec = now.tv_usec - pic->time.tv_usec;
+	secs = pic->time.tv_sec + pic->time.tv_usec/1000000.0f;
+		
+	if(pic->opt->verbose) {
+		if(secs<0.0001) printf("done (%.1fus", secs*1000000.0f);
+		else if(secs<1) printf("done (%.1fms", secs*1000.0f);
+		else            printf("done (%.1fs",  secs);
+		if(pic->saved_size>0) printf(", %d bytes", pic->saved_size);
+		if(pic->opt->best) printf(", raw/exo/zx0/span: %d/%d/%d/%d sectors",
+			(pic->format_size[0] + SECTOR_SIZE-1)/SECTOR_SIZE,
+			(pic->format_size[1] + SECTOR_SIZE-1)/SECTOR_SIZE,
+			(pic->format_size[2] + SECTOR_SIZE-1)/SECTOR_SIZE,
+			(pic->format_size[3] + SECTOR_SIZE-1)/SECTOR_SIZE);
+		if(pic->opt->best && pic->opt->target_time >= 0) {
+			for(i = 0; i < 4; ++i) {
+				printf(i ? "/" : ", ");
+				if(pic->format_time[i] < DBL_MAX) 
+					printf("%.2f", pic->format_time[i]);
+				else	printf("?");	/* undecodable */
+			}
+			printf("s");
+		}
+		printf(")\n");
+	}
+	
+	return secs;
+}
+
+PRIVATE const char *basename(const char *s) {
+	const char *t = s;
+	while(*t) ++t;
+	while(t>s && t[-1]!='/' && t[-1]!='\\') --t;
+	return t;
+}
+
+PRIVATE void squale_coord(pic *pic, int x, int y, int *rx, int *ry) {
+	const int w = pic->w, h = pic->h;
+	const uint8_t centered = pic->opt->centered;
+	float fx, fy, k = pic->opt->aspect_ratio;
+	if(w<=h*k) {
+		fx = (x*h*k)/256  + (centered ? 0.5f*(w - h*k) : 0);
+		fy = (y*h)/256;
+	} else {
+		fx = (x*w)/256;
+		fy = (y*w/k)/256 + (centered ? 0.5f*(h - w/k) : 0);
+	}
+	*rx = nearbyintf(fx);
+	*ry = nearbyintf(fy);
+}
+
+/* row j of the source in 16 bits linear, buf being used if needed */
+PRIVATE const uint16_t *pic_row16(pic *pic, const int j, uint16_t *buf) {
+	const uint8_t *img = pic->sRGB + 3*pic->w*j;
+	int i;
+	
+	if(pic->lin) return pic->lin + 3*pic->w*j;
+	
+	for(i = 0; i < 3*pic->w; ++i) buf[i] = sRGB2lin16(img[i]);
+	return buf;
+}
+
+/* Histogram of the 16 bits luminance of an image, filled a row at a 
+   time. The percentiles are read from the cumulated counts. */
+typedef struct histogram {
+	uint32_t count[65536];
+	uint32_t total;
+} histogram;
+
+PRIVATE histogram *histogram_new(void) {
+	histogram *h = calloc(1, sizeof(*h));
+	if(!h) OUT_OF_MEM((int)sizeof(*h));
+	return h;
+}
+
+/* adds n pixels of 16 bits linear rgb. 13933, 46871 and 4732 are the 
+   Rec.709 weights in 16.16, summing to 65536. */
+PRIVATE void histogram_add_row(histogram *h, const uint16_t *rgb, const int n) {
+	int i;
+	for(i = 0; i < n; ++i, rgb += 3) 
+		++h->count[(13933*(uint32_t)rgb[0] + 46871*(uint32_t)rgb[1] + 
+		            4732*(uint32_t)rgb[2] + 32768) >> 16];
+	h->total += n;
+}
+
+/* luminance of rank r (0 = darkest) */
+PRIVATE uint16_t histogram_rank(const histogram *h, uint32_t r) {
+	uint32_t cumul = 0;
+	int v;
+	for(v = 0; v < 65535; ++v) {
+		cumul += h->count[v];
+		if(cumul > r) break;
+	}
+	return v;
+}
+
+/* luminance below which fraction p of the pixels are, in [0,1] */
+PRIVATE float histogram_percentile(const histogram *h, const float p) {
+	float t = (h->total-1)*p;
+	uint32_t i = floorf(t);
+	float a = histogram_rank(h, i), b = i+1 < h->total ? histogram_rank(h, i+1) : a;
+	t -= i;
+	return (a + t*(b - a))/65535.0f;
+}
+
+/* sets the levels from the histogram of the source */
+PRIVATE void pic_norm(pic *pic, const histogram *histo, const float bl, const float wl) {
+	const float b = bl>=0 ? histogram_percentile(histo, bl) : 0;
+	const float w = wl>=0 ? histogram_percentile(histo, wl) : 1;
+	
+	if(pic->opt->verbose>1) printf("%.1f%%->%.1f%%...", b*100.0f, w*100.0f);
+	
+	if(b!=0 && w!=1 && b<w) {
+		pic->norm_0 = b;
+		pic->norm_1 = sRGB2lin(255)/(w - b);
+	} else pic->norm_0 = pic->norm_1 = -1;
+}
+
+/* size of the source after the hq_zoom resize, TRUE if it changes */
+PRIVATE int pic_zoom_size(pic *pic, int *rw, int *rh) {
+	int w = pic->w, h = pic->h;
+	
+#ifdef STBIR_INCLUDE_STB_IMAGE_RESIZE2_H
+	if(pic->opt->hq_zoom) {
+		if(h>w*pic->opt->aspect_ratio) {
+			w = (w*256)/h;
+			h = 256;
+		} else {
+			h = (h*256)/w;
+			w = 256;
+		}
+	}
+#endif
+	if(rw) *rw = w;
+	if(rh) *rh = h;
+	
+	return w!=pic->w || h!=pic->h;
+}
+
+/* the whole of stdin, for "-" as input file */
+PRIVATE struct membuf stdin_buf;
+
+PRIVATE int read_stdin(void) {
+	char buf[65536];
+	size_t n;
+	
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	membuf_init(&stdin_buf);
+	while((n = fread(buf, 1, sizeof(buf), stdin)) > 0) 
+		membuf_append(&stdin_buf, buf, n);
+	
+	return !ferror(stdin);
+}
+
+PRIVATE int pic_load(pic *pic, const char *filename) {
+	int raw, n;
+	
+	if(!pic->src && !strcmp(filename, "-")) {
+		pic->src     = membuf_get(&stdin_buf);
+		pic->src_len = membuf_memlen(&stdin_buf);
+		pic->src_w   = 0;
+	}
+	raw = pic->src && pic->src_w > 0;
+	
+	gettimeofday(&pic->time, NULL);
+	memset(pic->stage_time, 0, sizeof(pic->stage_time));
+	pic->saved_size = 0;
+	pic->norm_0 = pic->norm_1 = -1;
+	pic->crc = 0;
+	pic->name = filename;
+	pic->stream = NULL;
+	pic->sRGB = NULL;
+	pic->lin = NULL;
+	pic->plane = NULL;
+	membuf_init(&pic->sqp);
+	
+	if(raw) {
+		pic->w = pic->src_w;
+		pic->h = pic->src_h;
+	}
+	
+	/* no need to have everything in memory, unless stb_image_resize is
+	   used: only --low (or a source already about the right size) reads a
+	   big PPM/PGM/PAM/BMP one row at a time */
+	pic->stream = pic->src ? NULL : pic_stream_open(filename);
+	if(pic->stream) {
+		pic->w = pic->stream->w;
+		pic->h = pic->stream->h;
+		if(pic_zoom_size(pic, NULL, NULL)) {
+			pic_stream_close(pic->stream);
+			pic->stream = NULL;
+		}
+	}
+	
+	if(!pic->stream && !raw && !(pic->src ? 
+	   stbi_info_from_memory(pic->src, pic->src_len, &pic->w, &pic->h, &n) :
+	   stbi_info(filename, &pic->w, &pic->h, &n))) {
+		FATAL("Unsupported image: %s", filename, 0);
+		return FALSE;
+	}
+	
+	if(pic->opt->verbose) {	
+		printf("%s (%dx%d)...", basename(filename), pic->w, pic->h);
+		fflush(stdout);
+	}
+	
+	if(pic->stream) return TRUE;
+	
+	if(raw) {
+		const size_t len = 3*(size_t)pic->w*pic->h;
+		pic->sRGB = malloc(len);
+		if(pic->sRGB == NULL) OUT_OF_MEM((int)len);
+		memcpy(pic->sRGB, pic->src, len);
+		return TRUE;
+	}
+	
+	pic->sRGB = pic->src ? 
+		stbi_load_from_memory(pic->src, pic->src_len, &pic->w, &pic->h, &n, 3) :
+		stbi_load(filename, &pic->w, &pic->h, &n, 3);
+	
+	if(pic->sRGB == NULL)  {
+		FATAL("Error while loading: %s", filename, 0);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/* CRC tables, filled by init(): MSB-first CRC-32 for the %N names and 
+   reflected CRC-64 (ECMA-182, as in xz) for the artifact store */
+#define CRC32_POLY 0x04C11DB7
+#define CRC64_POLY 0xC96C5795D7870F42ULL
+PRIVATE uint32_t crc32_table[256];
+PRIVATE uint64_t crc64_table[256];
+
+PRIVATE void crc_init(void) {
+	int i, j;
+	for(i = 0; i < 256; ++i) {
+		uint32_t c = (uint32_t)i << 24;
+		uint64_t d = i;
+		for(j = 0; j < 8; ++j) {
+			c = c & 0x80000000 ? (c << 1) ^ CRC32_POLY : c << 1;
+			d = d & 1 ? (d >> 1) ^ CRC64_POLY : d >> 1;
+		}
+		crc32_table[i] = c;
+		crc64_table[i] = d;
+	}
+}
+
+PRIVATE uint64_t crc64(uint64_t crc, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	crc = ~crc;
+	while(len--) crc = crc64_table[(crc ^ *p++) & 255] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* the plane is hashed from the end, high byte first, so that the names 
+   are the same as with the former bitwise version */
+PRIVATE uint32_t pic_crc32(pic *pic) {
+	const uint16_t *v = &pic->plane[0][0];
+	uint32_t crc = ~0; int i;
+	for(i = 65536*3; --i>=0;) {
+		crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ (v[i] >> 8)];
+		crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ (v[i] & 255)];
+	}
+	return ~crc;
+}
+
+/* number of cores, 1 if unknown */
+PRIVATE int cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+PRIVATE double wall_time(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/* CPU time of the calling thread, so that the speedup isn't overstated 
+   when there are less cores than threads */
+PRIVATE double thread_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+/* Compressor settings raced by --search-time/--search-threads, the 
+   fastest first. Only the parameters of the encoders change, not the 
+   format read by SQPSHOW. The exomizer ones come from the timings below
+   (max_len max_offset imprecise_rle size time). */
 // 21668
 // 
 
@@ -1090,459 +2181,2951 @@ PRIVATE void pic_save(pic *pic, const char *filename) {
 
 // 512 1024 0 42235   sqp	59m
 
+PRIVATE const struct encoder_setting {
+	int max_len, max_offset, imprecise_rle;	/* exomizer */
+	int window;				/* salvador */
+} exo_settings[] = {
+	{  512,   512, 1, 0},
+	{ 1024,  1024, 1, 0},
+	{ 2048,  2048, 1, 0},
+	{  256,  4096, 1, 0},
+	{  512,  1024, 0, 0},
+	{65535, 65535, 1, 0},
+	{65535, 65535, 0, 0},			/* CRUNCH_OPTIONS_DEFAULT */
+}, zx0_settings[] = {
+	{0, 0, 0,  1024},
+	{0, 0, 0,  4096},
+	{0, 0, 0, 16384},
+	{0, 0, 0,     0},			/* default (max.) */
+};
 
+/* compresses the 65536 bytes of in[] with exomizer or salvador into out,
+   NULL settings being the defaults */
+PRIVATE void encode(const uint8_t *in, const uint8_t zx0, 
+                    const struct encoder_setting *set, struct membuf *out) {
+	if(zx0) {
+		size_t nOriginalSize = 65536, 
+		       nCompressedSize = 0, 
+		       nMaxWindowSize = set ? set->window : 0,
+		       nMaxCompressedSize;
+                int nFlags = 0;
+		uint8_t *buf;
+		
+		nMaxCompressedSize = salvador_get_max_compressed_size(nOriginalSize);
+		buf = malloc(nMaxCompressedSize);
+		if(!buf) OUT_OF_MEM(nMaxCompressedSize);
 
-//		options->max_len = 256;
-//		options->max_offset = 4096;
-//		options->use_imprecise_rle = 1;
-
-		membuf_init(inbuf);
-		do {
-			--i;
-			membuf_append(inbuf, &pic->bitmap[i^0xFF00], 1);
-		} while(i);
+		memset(buf, 0, nMaxCompressedSize);
+		nCompressedSize = salvador_compress(in, buf, nOriginalSize, nMaxCompressedSize, nFlags, nMaxWindowSize, 0, NULL, NULL);
+		 
+		if(nCompressedSize==(size_t)-1)
+		FATAL("Failed to compress (window %d)", (int)nMaxWindowSize, -1);	
 
-		membuf_init(outbuf);
-	        crunch(inbuf, outbuf, options, info);		
-		fwrite(membuf_get(outbuf), 1, membuf_memlen(outbuf), f);
-		membuf_free(outbuf);
+		membuf_append(out, buf, nCompressedSize);
+		free(buf);
+	} else {
+		struct membuf inbuf[1];
+		struct crunch_info info[1];
+		struct crunch_options options[1] = { CRUNCH_OPTIONS_DEFAULT };
 		
+		if(set) {
+			options->max_len = set->max_len;
+			options->max_offset = set->max_offset;
+			options->use_imprecise_rle = set->imprecise_rle;
+		}
+		
+		membuf_init(inbuf);
+		membuf_append(inbuf, in, 65536);
+	        crunch(inbuf, out, options, info);		
 		membuf_free(inbuf);
-	} else {
-		int i = 65536;
-		do {
-			i -= 2;
-			fputc(pic->bitmap[i^0xFF00]*16+pic->bitmap[(i^0xFF00)+1], f);
-		} while(i);
 	}
-	fflush(f);
-	pic->saved_size = ftell(f);
+}
+
+/* SQPSHOW's cost of a SQP file, see sqp_decode() */
+typedef struct sqp_cost {
+	long cycles;
+	int sectors;
+} sqp_cost;
+
+PRIVATE double sqp_time(const int version, const uint8_t *data, const size_t len);
+
+/* --target-time: the smallest of the files displayed in the time given
+   is preferred, or else the fastest. Returns <0 if (size1, t1) is to
+   be preferred to (size2, t2), >0 for the reverse, 0 for a tie. */
+PRIVATE int target_cmp(const float target, const long size1, const double t1, 
+                       const long size2, const double t2) {
+	const int fit1 = t1 <= target, fit2 = t2 <= target;
+	
+	if(fit1 != fit2) return fit1 ? -1 : 1;
+	if(fit1 && size1 != size2) return size1 < size2 ? -1 : 1;
+	return t1 < t2 ? -1 : t1 > t2;
+}
+
+/* State of a race. No setting is started once the time is up, but the
+   compressors can't be interrupted: the ones running then are waited 
+   for, so that no work is left behind to slow down the next images. */
+typedef struct search {
+	uint8_t in[65536], zx0;
+	const struct encoder_setting *set;
+	int count, next, done;
+	int best;
+	struct membuf best_out;
+	float target;			/* --target-time */
+	double best_time;
+	double deadline;		/* 0 for none */
+	stats stats;			/* bytes compressed */
+	pthread_mutex_t lock;
+} search;
+
+PRIVATE void *search_thread(void *arg) {
+	search *s = arg;
+	
+	pthread_mutex_lock(&s->lock);
+	while(s->next < s->count && (!s->deadline || wall_time() < s->deadline)) {
+		const int i = s->next++;
+		struct membuf out;
+		
+		double t = 0;
+		long len, best_len;
+		int c;
+		
+		pthread_mutex_unlock(&s->lock);
+		membuf_init(&out);
+		encode(s->in, s->zx0, &s->set[i], &out);
+		len = membuf_memlen(&out);
+		if(s->target >= 0) 
+			t = sqp_time(s->zx0 ? SQP_ZX0 : SQP_EXO, membuf_get(&out), len);
+		pthread_mutex_lock(&s->lock);
+		
+		/* ties go to the first setting, so that an unlimited search
+		   is reproducible */
+		STAT(&s->stats, comp_in, sizeof(s->in));
+		STAT(&s->stats, comp_out, len);
+		best_len = membuf_memlen(&s->best_out);
+		if(s->best < 0) c = -1;
+		else if(s->target < 0) c = (len > best_len) - (len < best_len);
+		else c = target_cmp(s->target, len, t, best_len, s->best_time);
+		if(c < 0 || (c == 0 && i < s->best)) {
+			struct membuf tmp = s->best_out;
+			s->best_out = out; out = tmp;
+			s->best = i;
+			s->best_time = t;
+		}
+		membuf_free(&out);
+		++s->done;
+	}
+	pthread_mutex_unlock(&s->lock);
+	
+	return NULL;
+}
+
+/* compresses in[] with the settings of the format on several threads,
+   appending the smallest result found in the time given to out */
+PRIVATE void encode_search(pic *pic, const uint8_t zx0, const uint8_t *in, 
+                           struct membuf *out, stats *st) {
+	const options *opt = pic->opt;
+	search *s = calloc(1, sizeof(*s));
+	pthread_t *tid;
+	int i, n = opt->search_threads;
+	
+	if(!s) OUT_OF_MEM((int)sizeof(*s));
+	memcpy(s->in, in, sizeof(s->in));
+	s->zx0      = zx0;
+	s->set      = zx0 ? zx0_settings : exo_settings;
+	s->count    = zx0 ? length_of(zx0_settings) : length_of(exo_settings);
+	s->best     = -1;
+	s->deadline = opt->search_time > 0 ? wall_time() + opt->search_time : 0;
+	s->target   = opt->target_time;
+	membuf_init(&s->best_out);
+	pthread_mutex_init(&s->lock, NULL);
+	
+	if(n <= 0) n = cpu_count();
+	if(n > s->count) n = s->count;
+	
+	tid = malloc(n*sizeof(*tid));
+	if(!tid) OUT_OF_MEM((int)(n*sizeof(*tid)));
+	for(i = 0; i < n; ++i) 
+		if(pthread_create(&tid[i], NULL, search_thread, s))
+		FATAL("Can't create thread %d", i, -1);
+	for(i = 0; i < n; ++i) pthread_join(tid[i], NULL);
+	free(tid);
+	
+	if(s->best < 0) {
+		/* the time was up before any setting could start */
+		encode(s->in, zx0, NULL, &s->best_out);
+		STAT(&s->stats, comp_in, sizeof(s->in));
+		STAT(&s->stats, comp_out, membuf_memlen(&s->best_out));
+	}
+	
+	if(opt->verbose > 1) printf("%d/%d settings tried, #%d best...", 
+		s->done, s->count, s->best);
+	membuf_append(out, membuf_get(&s->best_out), membuf_memlen(&s->best_out));
+	stats_add(st, &s->stats);
+	membuf_free(&s->best_out);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/* Artifact store (--store): the compressed SQP files are kept in a
+   directory, named after the CRC-64 of the bitmap and of the compressor
+   settings, so that an image that dithers the same is not compressed 
+   again. Files are written under a temporary name then renamed, so that
+   several processes can share the store. Only the searches without time
+   limit are stored: they try all the settings, so that their result does
+   not depend on the number of threads nor on the machine. */
+PRIVATE uint64_t store_key(pic *pic, const int version, const uint8_t search) {
+	const options *opt = pic->opt;
+	char id[32];
+	
+	if(search && opt->target_time >= 0) 
+		snprintf(id, sizeof(id), "SQP%d+target%g", version, opt->target_time);
+	else	snprintf(id, sizeof(id), "SQP%d%s", version, search ? "+search" : "");
+	return crc64(crc64(0, pic->bitmap, sizeof(pic->bitmap)), id, strlen(id));
+}
+
+PRIVATE char *store_path(uint64_t key, const char *ext) {
+	int l = strlen(store_dir) + 16 + 32;
+	char *s = malloc(l);
+	if(!s) OUT_OF_MEM(l);
+	snprintf(s, l, "%s/%016llx.sqp%s", store_dir, (unsigned long long)key, ext);
+	return s;
+}
+
+/* replaces sqp with the stored file if any, keeping its header */
+PRIVATE int store_get(uint64_t key, struct membuf *sqp) {
+	char *path = store_path(key, ""), hd[4];
+	FILE *f = fopen(path, "rb");
+	int ok = FALSE;
+	
+	free(path);
+	if(f == NULL) return FALSE;
+	if(fread(hd, 1, 4, f) == 4 && !memcmp(hd, membuf_get(sqp), 4)) {
+		char buf[4096];
+		size_t n;
+		
+		while((n = fread(buf, 1, sizeof(buf), f)) > 0) 
+			membuf_append(sqp, buf, n);
+		ok = !ferror(f) && membuf_memlen(sqp) > 4;
+		if(!ok) {membuf_clear(sqp); membuf_append(sqp, hd, 4);}
+	}
+	fclose(f);
+	
+	return ok;
+}
+
+PRIVATE void store_put(uint64_t key, struct membuf *sqp) {
+	char *path = store_path(key, ""), *tmp;
+	char ext[32];
+	FILE *f;
+	
+	snprintf(ext, sizeof(ext), ".%d.%lx", (int)getpid(), (unsigned long)(size_t)sqp);
+	tmp = store_path(key, ext);
+	
+#ifdef _WIN32
+	mkdir(store_dir);
+#else
+	mkdir(store_dir, 0777);
+#endif
+	f = fopen(tmp, "wb");
+	if(f == NULL) perror(tmp);
+	else {
+		int ok = fwrite(membuf_get(sqp), 1, membuf_memlen(sqp), f) 
+		         == membuf_memlen(sqp);
+		if(fclose(f) || !ok) remove(tmp);
+#ifdef _WIN32
+		else if(rename(tmp, path)) {remove(path); rename(tmp, path);}
+#else
+		else rename(tmp, path);
+#endif
+		remove(tmp);
+	}
+	free(tmp);
+	free(path);
+}
+
+/* bytes given to the compressor, in the order of the SQPSHOW decoder */
+PRIVATE void pic_encoder_input(pic *pic, const uint8_t zx0, uint8_t *in) {
+	int i;
+	
+	/* exomizer decrunches backward */
+	if(zx0) for(i=0; i<65536; ++i) in[i] = pic->bitmap[i ^ 0x00FF];
+	else    for(i=0; i<65536; ++i) in[i] = pic->bitmap[(65535-i) ^ 0xFF00];
+}
+
+/* Estimated compressed size of in[] in bytes, in a few milliseconds. 
+   This is a greedy LZ parse on hash chains with an exomizer-like cost: 
+   9 bits per literal, and 1 bit plus the elias-gamma code of the length
+   plus a 4 bits offset class and its extra bits per match. It is only 
+   meant to rank bitmaps, not to predict the exact size. */
+#define LZ_HASH_BITS	14
+#define LZ_DEPTH	16
+
+PRIVATE int lz_bits(uint32_t v) {
+	int n = 0;
+	while(v) {++n; v >>= 1;}
+	return n;
+}
+
+PRIVATE int lz_estimate(const uint8_t *in, const int n) {
+	int32_t *head = malloc((1<<LZ_HASH_BITS)*sizeof(*head));
+	int32_t *prev = malloc(n*sizeof(*prev));
+	int64_t bits = 0;
+	int i = 0, j;
+	
+	if(!head || !prev) OUT_OF_MEM((int)(n*sizeof(*prev)));
+	for(j = 0; j < 1<<LZ_HASH_BITS; ++j) head[j] = -1;
+	
+#define LZ_HASH(p) ((((p)[0]<<8 ^ (p)[1]<<4 ^ (p)[2])*2654435761u) >> (32-LZ_HASH_BITS))
+#define LZ_INSERT(k) if((k)+2 < n) {					\
+		const uint32_t h = LZ_HASH(in + (k));			\
+		prev[k] = head[h]; head[h] = (k);			\
+	}
+	while(i < n) {
+		int len = 0, off = 0, cost, d;
+		
+		if(i+2 < n) for(j = head[LZ_HASH(in + i)], d = 0; 
+		                j >= 0 && d < LZ_DEPTH && i-j <= 65535; 
+		                j = prev[j], ++d) {
+			int l = 0;
+			while(i+l < n && l < 65535 && in[j+l] == in[i+l]) ++l;
+			if(l > len) {len = l; off = i-j;}
+		}
+		
+		cost = len < 3 ? 0 : 1 + 2*lz_bits(len) - 1 + 4 + lz_bits(off);
+		if(cost && cost < 9*len) {
+			bits += cost;
+			for(j = i + len; i < j; ++i) LZ_INSERT(i);
+		} else {
+			bits += 9;
+			LZ_INSERT(i);
+			++i;
+		}
+	}
+#undef LZ_INSERT
+#undef LZ_HASH
+	
+	free(prev);
+	free(head);
+	
+	return (bits + 7)/8;
+}
+
+/* SQP4: the lines from the top, each made of horizontal runs from the
+   left that SQPSHOW draws with the EF9365. A byte holds the color of 
+   the run in its high nibble and its length minus one in its low one, 
+   15 meaning that the length minus one is in the next byte. */
+PRIVATE void encode_spans(const uint8_t *bitmap, struct membuf *out) {
+	int y, x, n;
+	
+	for(y = 0; y < 256; ++y) for(x = 0; x < 256; x += n) {
+		const uint8_t *p = &bitmap[y*256 + x];
+		uint8_t b[2];
+		
+		for(n = 1; x + n < 256 && p[n] == p[0]; ++n);
+		b[0] = p[0]*16 + (n < 16 ? n-1 : 15);
+		b[1] = n-1;
+		membuf_append(out, b, n < 16 ? 1 : 2);
+	}
+}
+
+/* builds the SQP file of the given version in sqp. This is the costly 
+   part with exomizer or ZX0 unless it is found in the store. It can be
+   run in a worker thread, so the bytes compressed go to st. */
+PRIVATE void pic_encode_as(pic *pic, const int version, struct membuf *sqp,
+                           stats *st) {
+	const options *opt = pic->opt;
+	const uint8_t hd[4] = {'S', 'Q', 'P', version};
+	
+	membuf_clear(sqp);
+	membuf_append(sqp, hd, 4);
+	
+	if(version == SQP_EXO || version == SQP_ZX0) {
+		const uint8_t zx0 = version == SQP_ZX0;
+		/* no search without time for it */
+		const uint8_t search = opt->search_time != 0 && (opt->search_threads 
+			|| opt->search_time > 0 || opt->target_time >= 0);
+		/* a time-bounded search depends on the speed of the machine */
+		const uint8_t store = store_dir && !(search && opt->search_time > 0);
+		uint8_t *in = malloc(65536);
+		uint64_t key = 0;
+		
+		if(!in) OUT_OF_MEM(65536);
+		
+		if(store) {
+			key = store_key(pic, version, search);
+			if(store_get(key, sqp)) {
+				if(opt->verbose>1) printf("%016llx stored...", 
+					(unsigned long long)key);
+				free(in);
+				return;
+			}
+		}
+		
+		pic_encoder_input(pic, zx0, in);
+		
+		if(search) encode_search(pic, zx0, in, sqp, st);
+		else {
+			encode(in, zx0, NULL, sqp);
+			STAT(st, comp_in, 65536);
+			STAT(st, comp_out, membuf_memlen(sqp) - 4);
+		}
+		
+		if(store) store_put(key, sqp);
+		free(in);
+	} else if(version == SQP_SPAN) {
+		encode_spans(pic->bitmap, sqp);
+	} else {
+		uint8_t *out = membuf_append(sqp, NULL, 32768);
+		int i = 65536;
+		do {
+			i -= 2;
+			*out++ = pic->bitmap[i^0xFF00]*16+pic->bitmap[(i^0xFF00)+1];
+		} while(i);
+	}
+}
+
+/* --best: the versions are built in parallel and the one taking
+   the less FLEX sectors is kept. On ties, the one that SQPSHOW displays
+   the fastest is preferred, as estimated by sqp_time(), and then the 
+   usually faster: the spans drawn by the EF9365, raw that only reads a
+   byte every two pixels, then ZX0, then the bit-oriented exomizer. 
+   With --target-time, the display times come first, see target_cmp(). */
+struct encode_job {
+	pic *pic;
+	int version;
+	struct membuf sqp;
+	stats stats;
+	pthread_t tid;
+};
+
+PRIVATE void *encode_thread(void *arg) {
+	struct encode_job *job = arg;
+	pic_encode_as(job->pic, job->version, &job->sqp, &job->stats);
+	return NULL;
+}
+
+PRIVATE void pic_encode_best(pic *pic) {
+	static const int by_speed[4] = {SQP_SPAN, SQP_RAW, SQP_ZX0, SQP_EXO};
+	const options *opt = pic->opt;
+	struct encode_job job[4];
+	int i, best = 0, sectors[4];
+	double t[4];
+	
+	for(i = 0; i < 4; ++i) {
+		job[i].pic = pic;
+		job[i].version = by_speed[i];
+		membuf_init(&job[i].sqp);
+		memset(&job[i].stats, 0, sizeof(job[i].stats));
+	}
+	
+	/* the spans and raw ones are immediate */
+	for(i = 2; i < 4; ++i) 
+		if(pthread_create(&job[i].tid, NULL, encode_thread, &job[i]))
+		FATAL("Can't create thread %d", i, -1);
+	encode_thread(&job[0]);
+	encode_thread(&job[1]);
+	for(i = 2; i < 4; ++i) pthread_join(job[i].tid, NULL);
+	
+	for(i = 0; i < 4; ++i) {
+		const int len = membuf_memlen(&job[i].sqp);
+		sectors[i] = (len + SECTOR_SIZE-1)/SECTOR_SIZE;
+		t[i] = sqp_time(job[i].version, 
+			(uint8_t*)membuf_get(&job[i].sqp) + 4, len - 4);
+		pic->format_size[job[i].version - 1] = len;
+		stats_add(&pic->wk->stats, &job[i].stats);
+		pic->format_time[job[i].version - 1] = t[i];
+		if(opt->target_time < 0 ? sectors[i] < sectors[best] 
+		   || (sectors[i] == sectors[best] && t[i] < t[best])
+		 : target_cmp(opt->target_time, sectors[i], t[i], sectors[best], t[best]) < 0)
+			best = i;
+	}
+	
+	membuf_clear(&pic->sqp);
+	membuf_append(&pic->sqp, membuf_get(&job[best].sqp), membuf_memlen(&job[best].sqp));
+	for(i = 0; i < 4; ++i) membuf_free(&job[i].sqp);
+}
+
+/* builds the SQP file in memory (pic->sqp) */
+PRIVATE void pic_encode(pic *pic) {
+	const options *opt = pic->opt;
+	
+	if(opt->best) pic_encode_best(pic);
+	else pic_encode_as(pic, opt->zx0 ? SQP_ZX0 : opt->exo ? SQP_EXO : 
+		opt->span ? SQP_SPAN : SQP_RAW, &pic->sqp, &pic->wk->stats);
+}
+
+/* Reference decoder of the SQP files, following SQPSHOW.ASM step by step
+   so that it fails where SQPSHOW would. The pixels are set at decreasing
+   addresses Y from $FFFF, the one at Y being bitmap[Y ^ $FF00] as in
+   pic_encode_as(). Copies read the pixels already set at Y+offset. 
+   
+   It also counts the 6809 cycles that SQPSHOW spends, calls included,
+   to estimate the time to display the file. The instructions are timed
+   from the listing; FLEX and the EF9365 are not, so their costs below
+   are estimates: FMS returning a byte from its sector buffer, bringing
+   the next sector from the floppy, and the EF9365 drawing a vector. */
+#define SQPSHOW_HZ		1000000	/* 6809 clock */
+#define CYC_FMS			150	/* FMS call, byte in the buffer */
+#define CYC_SECTOR		20000	/* FMS call, next sector */
+#define CYC_GFX_CMD		4	/* EF9365 command */
+#define CYC_GFX_PIXEL		1	/* EF9365 vector, per pixel */
+
+#define CYC_READ		(40 + CYC_FMS)
+
+typedef struct sqp_decoder {
+	const uint8_t *sqp, *p, *end;
+	uint8_t *bitmap;
+	uint16_t y;
+	uint8_t bits;			/* bit buffer, with a sentinel */
+	int err;
+	long cycles;
+	int sectors;
+	long gfx;			/* cycle at which the EF9365 is ready */
+	uint16_t pycache;		/* PYCACHE */
+} sqp_decoder;
+
+PRIVATE uint8_t sqp_read(sqp_decoder *d) {
+	d->cycles += CYC_READ;
+	if(d->p < d->end) {
+		if((d->p - d->sqp) % SECTOR_SIZE == 0) {
+			d->cycles += CYC_SECTOR;
+			++d->sectors;
+		}
+		return *d->p++;
+	}
+	d->err = TRUE;
+	return 0;
+}
+
+/* GFXWAIT */
+PRIVATE void sqp_gfxwait(sqp_decoder *d) {
+	d->cycles += 30;
+	if(d->cycles < d->gfx) d->cycles = d->gfx;
+}
+
+/* PFLUSH: the line held by PXCACHE is drawn as horizontal runs */
+PRIVATE void sqp_pflush(sqp_decoder *d) {
+	const uint8_t *line = &d->bitmap[d->y ^ 0xFF00];
+	int x = 0;
+	
+	d->cycles += 37;
+	while(x < 256) {
+		int r = 1;
+		while(x + r < 256 && line[x + r] == line[x]) ++r;
+		d->cycles += 21 + 11*r;
+		sqp_gfxwait(d);
+		d->cycles += 32;
+		d->gfx = d->cycles + CYC_GFX_CMD + CYC_GFX_PIXEL*r;
+		x += r;
+	}
+	sqp_gfxwait(d);
+	d->cycles += 3;
+}
+
+/* PSET, the pixel at Y being in PXCACHE until its line is complete */
+PRIVATE void sqp_pset(sqp_decoder *d, const uint8_t c) {
+	--d->y;
+	d->bitmap[d->y ^ 0xFF00] = c & 15;
+	d->cycles += 53;
+	d->pycache = ((d->y + 256) & 0xFF00) | (d->y & 255);
+	if((d->y & 255) == 0) sqp_pflush(d);
+}
+
+/* DPSET */
+PRIVATE void sqp_dpset(sqp_decoder *d, const uint8_t c) {
+	d->cycles += 15;
+	sqp_pset(d, c);
+}
+
+/* PGETSET, the pixels of the lines already drawn being read back from
+   the EF9365 */
+PRIVATE void sqp_pgetset(sqp_decoder *d, const uint16_t offset) {
+	const uint16_t a = d->y - 1 + offset;
+	const uint8_t c = d->bitmap[a ^ 0xFF00];
+	
+	if(a < d->pycache)		d->cycles += 51;
+	else if(!(d->pycache >> 8))	d->cycles += 64;
+	else {
+		d->cycles += 63;
+		if(d->cycles < d->gfx) d->cycles = d->gfx;
+		d->cycles += 39 + CYC_GFX_CMD 
+		          + (a & 2 ? 2 : 0) + (a & 1 ? 0 : 8);
+	}
+	sqp_pset(d, c);
+}
+
+/* SQP1: two pixels per byte, low nibble first */
+PRIVATE void sqp_decode_raw(sqp_decoder *d) {
+	do {	const uint8_t a = sqp_read(d);
+		sqp_dpset(d, a);
+		sqp_dpset(d, a >> 4);
+		d->cycles += 15;
+	} while(d->y && !d->err);
+}
+
+/* SQP2: EXOBITS reads n bits, MSB first, from bytes consumed LSB first */
+PRIVATE uint16_t sqp_exo_bits(sqp_decoder *d, int n) {
+	uint16_t v = 0;
+	d->cycles += n ? 35 : 30;
+	while(--n >= 0) {
+		int c = d->bits & 1;
+		d->bits >>= 1;
+		d->cycles += 23;
+		if(d->bits == 0) {
+			const uint8_t a = sqp_read(d);
+			c = a & 1;
+			d->bits = (a >> 1) | 128;
+			d->cycles += 4;
+		}
+		v = (v << 1) | c;
+	}
+	return v;
+}
+
+/* EXOBIT */
+PRIVATE int sqp_exo_bit(sqp_decoder *d) {
+	d->cycles += 2;
+	return sqp_exo_bits(d, 1);
+}
+
+/* EXOCOOK */
+PRIVATE uint16_t sqp_exo_cook(sqp_decoder *d, const uint8_t bits, 
+                              const uint16_t base) {
+	d->cycles += 34;
+	return base + sqp_exo_bits(d, bits);
+}
+
+PRIVATE void sqp_decode_exo(sqp_decoder *d) {
+	struct {uint8_t bits; uint16_t base;} tab[52];	/* EXOBIBA */
+	uint16_t x = 1;
+	int i;
+	
+	d->bits = sqp_read(d);
+	for(i = 0; i < 52; ++i) {
+		if((i & 15) == 0) x = 1;
+		tab[i].bits = sqp_exo_bits(d, 4);
+		tab[i].base = x;
+		x += 1 << tab[i].bits;
+		d->cycles += 60;
+	}
+	
+	while(!d->err) {
+		uint16_t len, offset;
+		int idx;
+		
+		/* EXOLOOP */
+		d->cycles += 8;
+		if(sqp_exo_bit(d)) len = 1;		/* literal */
+		else {
+			for(idx = 0; !sqp_exo_bit(d) && !d->err; ++idx) 
+				d->cycles += 15;
+			d->cycles += 15;
+			if(idx == 16) break;		/* end of data */
+			if(idx > 16) len = sqp_exo_bits(d, idx - 1);
+			else {
+				static const uint8_t exotab[6] = {4,2,4,16,48,32};
+				const uint8_t *t;
+				
+				/* EXOCOFF */
+				len = sqp_exo_cook(d, tab[idx].bits, tab[idx].base);
+				t = exotab + (len < 3 ? len : 0);
+				idx = (t[3] + sqp_exo_bits(d, t[0])) & 255;
+				offset = sqp_exo_cook(d, tab[idx].bits, tab[idx].base);
+				d->cycles += len < 3 ? 45 : 42;
+				do {	sqp_pgetset(d, offset);
+					d->cycles += 23;
+				} while(--len);
+				continue;
+			}
+		}
+		/* EXOCPY */
+		d->cycles += 9;
+		do {	sqp_dpset(d, sqp_read(d));
+			d->cycles += 8;
+		} while(--len && !d->err);
+	}
+}
+
+/* SQP3: the bit buffer is only refilled when reading a control bit 
+   of the elias gamma codes (ZX0ELI1) */
+PRIVATE int sqp_zx0_bit(sqp_decoder *d) {
+	const int c = d->bits >> 7;
+	d->bits <<= 1;
+	d->cycles += 6;
+	return c;
+}
+
+PRIVATE int sqp_zx0_ctrl(sqp_decoder *d) {
+	int c = sqp_zx0_bit(d);
+	d->cycles += 6;
+	if(d->bits == 0) {
+		const uint8_t a = sqp_read(d);
+		c = a >> 7;
+		d->bits = (a << 1) | 1;
+		d->cycles += 16;
+	}
+	return c;
+}
+
+/* ZX0ELIB: interlaced elias gamma code, its first control bit being c */
+PRIVATE uint16_t sqp_zx0_elias(sqp_decoder *d, int c) {
+	uint16_t v = 1;
+	while(!c && !d->err) {
+		v = (v << 1) | sqp_zx0_bit(d);
+		c = sqp_zx0_ctrl(d);
+		d->cycles += 4;
+	}
+	d->cycles += 5;
+	return v;
+}
+
+/* ZX0ELIA */
+PRIVATE uint16_t sqp_zx0_elia(sqp_decoder *d) {
+	d->cycles += 13;
+	return sqp_zx0_elias(d, sqp_zx0_ctrl(d));
+}
+
+PRIVATE void sqp_decode_zx0(sqp_decoder *d) {
+	uint16_t offset = 1, len = 0;
+	int new_offset = FALSE;
+	
+	d->bits = 0x80;
+	while(!d->err) {
+		if(!new_offset) {
+			/* ZX0LITS */
+			len = sqp_zx0_elia(d);
+			d->cycles += 6;
+			do {	sqp_dpset(d, sqp_read(d));
+				d->cycles += 10;
+			} while(--len && !d->err);
+			new_offset = sqp_zx0_bit(d);
+			d->cycles += 3;
+			if(!new_offset) len = sqp_zx0_elia(d);
+		}
+		if(new_offset) {
+			/* ZX0NEWO, with the 8 bits arithmetic of SQPSHOW */
+			uint8_t b = sqp_zx0_elia(d), a;
+			unsigned t;
+			
+			d->cycles += 5;
+			if(b == 0) break;		/* end of data */
+			t = (sqp_read(d) ^ 0xFE) + 2;
+			a = t;
+			b = b + 0xFF + (t >> 8);
+			offset = (b >> 1) << 8 | (b & 1) << 7 | a >> 1;
+			d->cycles += 38;
+			len = sqp_zx0_elias(d, a & 1) + 1;
+		}
+		/* ZX0COPY */
+		d->cycles += 6;
+		do {	sqp_pgetset(d, offset);
+			d->cycles += 24;
+		} while(--len && !d->err);
+		new_offset = sqp_zx0_bit(d);
+		d->cycles += 3;
+	}
+}
+
+/* SQP4: the runs are drawn by the EF9365 without going through PXCACHE.
+   A run going past the end of its line is an error. */
+PRIVATE void sqp_decode_span(sqp_decoder *d) {
+	int y, x;
+	
+	for(y = 0; y < 256 && !d->err; ++y) {
+		/* SQP4LIN */
+		d->cycles += 11 + 2;
+		sqp_gfxwait(d);
+		d->cycles += 26;
+		for(x = 0; x < 256 && !d->err; ) {
+			const uint8_t a = sqp_read(d);
+			int n = a & 15;
+			
+			d->cycles += 2 + 13;
+			if(n == 15) {
+				n = sqp_read(d);
+				d->cycles += 20 + 2;
+			}
+			if(x + n >= 256) {d->err = TRUE; break;}
+			memset(&d->bitmap[y*256 + x], a >> 4, n + 1);
+			x += n + 1;
+			
+			/* SQP4DRW */
+			d->cycles += 36 + 2;
+			sqp_gfxwait(d);
+			d->cycles += 23;
+			d->gfx = d->cycles + CYC_GFX_CMD + CYC_GFX_PIXEL*(n + 1);
+			d->cycles += 16;
+		}
+		d->cycles += 8;
+	}
+	d->cycles += 2;
+	sqp_gfxwait(d);
+}
+
+/* decodes the SQP file sqp[len] in bitmap[]. Returns FALSE if it is not
+   a SQP file or if SQPSHOW would read past its end. The cost is stored 
+   in cost if not NULL. */
+PRIVATE int sqp_decode(const uint8_t *sqp, const size_t len, uint8_t *bitmap,
+                       sqp_cost *cost) {
+	sqp_decoder d;
+	int i;
+	
+	if(len < 4 || memcmp(sqp, "SQP", 3)) return FALSE;
+	
+	d.sqp     = sqp;
+	d.p       = sqp;
+	d.end     = sqp + len;
+	d.bitmap  = bitmap;
+	d.y       = 0;
+	d.bits    = 0;
+	d.err     = FALSE;
+	d.cycles  = 0;
+	d.sectors = 0;
+	d.gfx     = 0;
+	d.pycache = 0;
+	
+	/* CHKBYT x3 and the version */
+	for(i = 0; i < 4; ++i) sqp_read(&d);
+	d.cycles += 3*28 + 12;
+	
+	switch(sqp[3]) {
+		case SQP_RAW: sqp_decode_raw(&d); break;
+		case SQP_EXO: sqp_decode_exo(&d); break;
+		case SQP_ZX0: sqp_decode_zx0(&d); break;
+		case SQP_SPAN: sqp_decode_span(&d); break;
+		default: return FALSE;
+	}
+	
+	if(cost) {
+		cost->cycles  = d.cycles;
+		cost->sectors = d.sectors;
+	}
+	
+	return !d.err;
+}
+
+/* seconds taken by SQPSHOW to display the SQP file of the given version
+   whose data, past the header, is data[len] */
+PRIVATE double sqp_time(const int version, const uint8_t *data, const size_t len) {
+	uint8_t *sqp = malloc(len + 4), *bitmap = malloc(65536);
+	sqp_cost cost;
+	double t = DBL_MAX;
+	
+	if(!sqp) OUT_OF_MEM((int)len + 4);
+	if(!bitmap) OUT_OF_MEM(65536);
+	memcpy(sqp, "SQP", 3);
+	sqp[3] = version;
+	memcpy(sqp + 4, data, len);
+	if(sqp_decode(sqp, len + 4, bitmap, &cost)) 
+		t = (double)cost.cycles/SQPSHOW_HZ;
+	free(bitmap);
+	free(sqp);
+	
+	return t;
+}
+
+/* writes the file at once from memory, "-" being stdout */
+PRIVATE int write_file(const char *filename, const void *buf, const size_t len) {
+	FILE *f = strcmp(filename, "-") ? fopen(filename, "wb") : stdout;
+	int ok;
+	
+	if(f == NULL) {perror(filename); return FALSE;}
+#ifdef _WIN32
+	if(f == stdout) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+	ok = fwrite(buf, 1, len, f) == len;
+	ok = (f == stdout ? fflush(f) : fclose(f)) == 0 && ok;
+	if(!ok) perror(filename);
+	
+	return ok;
+}
+
+PRIVATE void pic_save(pic *pic, const char *filename) {
+	if(pic->opt->verbose>1) {
+		printf("saving %s...", basename(filename));
+		fflush(stdout);
+	}
+	
+	if(write_file(filename, membuf_get(&pic->sqp), membuf_memlen(&pic->sqp)))
+		pic->saved_size = membuf_memlen(&pic->sqp);
+}
+
+/* --verify: decodes the file as written (from memory, as it is written 
+   at once) and compares it to the bitmap, telling how long SQPSHOW takes
+   to display it. --decode-bench also measures the decoding speed */
+PRIVATE void pic_verify(pic *pic, const char *filename) {
+	const options *opt = pic->opt;
+	const uint8_t *buf = membuf_get(&pic->sqp);
+	const long len = membuf_memlen(&pic->sqp);
+	uint8_t *bitmap = malloc(65536);
+	sqp_cost cost;
+	int i, n = 0;
+	
+	if(!bitmap) OUT_OF_MEM(65536);
+	
+	if(!sqp_decode(buf, len, bitmap, &cost)) {
+		fprintf(stderr, "%s: can't be decoded\n", filename);
+		exit_code = 1;
+	} else {
+		for(i = 0; i < 65536; ++i) n += bitmap[i] != pic->bitmap[i];
+		if(n) {
+			fprintf(stderr, "%s: %d pixels differ\n", filename, n);
+			exit_code = 1;
+		} else if(opt->verbose>1) printf("verified...");
+		if(opt->verbose) printf("%.2fs on SQPSHOW (%ld cycles, %d sectors)...",
+			(double)cost.cycles/SQPSHOW_HZ, cost.cycles, cost.sectors);
+	}
+	
+	if(opt->decode_bench > 0) {
+		double t = wall_time();
+		for(i = 0; i < opt->decode_bench; ++i) sqp_decode(buf, len, bitmap, NULL);
+		t = wall_time() - t;
+		decode_time   += t;
+		decode_pixels += 65536L*opt->decode_bench;
+		if(opt->verbose) printf("decoded in %.3fms...", 1000*t/opt->decode_bench);
+	}
+	
+	free(bitmap);
+}
+
+PRIVATE void pic_save_pgm(pic *pic, const char *filename) {
+	char *buf = malloc(16 + 65536*12), *s = buf;
+	int i;
+	
+	if(buf==NULL) OUT_OF_MEM(16 + 65536*12);
+	
+	if(pic->opt->verbose>1) {
+		printf("saving %s...", basename(filename));
+		fflush(stdout);
+	}
+	
+	s += sprintf(s, "P3\n256 256\n255\n");
+	for(i=0;i<65536;++i) {
+		int c = pic->bitmap[i]>=8 ? HALF_INTENSITY : FULL_INTENSITY;
+		s += sprintf(s, "%d %d %d\n", 
+			pic->bitmap[i] & 4 ? 0 : c,
+			pic->bitmap[i] & 2 ? 0 : c,
+			pic->bitmap[i] & 1 ? 0 : c);
+	}
+	write_file(filename, buf, s - buf);
+	free(buf);
+}
+
+/* the bitmap in RGB, 3*65536 bytes allocated */
+PRIVATE uint8_t *pic_rgb(pic *pic) {
+	uint8_t *buf = malloc(3*256*256), *rgb = buf;
+	int i;
+
+	if(buf==NULL) OUT_OF_MEM(3*256*256);
+	
+	for(i=0;i<65536;++i) {
+		int c = pic->bitmap[i]>=8 ? HALF_INTENSITY : FULL_INTENSITY;
+		*rgb++ = pic->bitmap[i] & 4 ? 0 : c;
+		*rgb++ = pic->bitmap[i] & 2 ? 0 : c;
+		*rgb++ = pic->bitmap[i] & 1 ? 0 : c;
+	}
+	
+	return buf;
+}
+
+PRIVATE void membuf_write(void *ctx, void *data, int size) {
+	membuf_append(ctx, data, size);
+}
+
+/* the png preview in memory */
+PRIVATE void pic_png(pic *pic, struct membuf *out) {
+	uint8_t *buf = pic_rgb(pic);
+	stbi_write_png_to_func(membuf_write, out, 256, 256, 3, buf, 3*256);
+	free(buf);
+}
+
+PRIVATE void pic_save_png(pic *pic, const char *filename) {
+	struct membuf png;
+	
+	if(pic->opt->verbose>1) {
+		printf("saving %s...", basename(filename));
+		fflush(stdout);
+	}
+	
+	membuf_init(&png);
+	pic_png(pic, &png);
+	write_file(filename, membuf_get(&png), membuf_memlen(&png));
+	membuf_free(&png);
+}
+
+PRIVATE void pic_save_gif(pic *pic, const char *filename) {
+	uint8_t palette[16*3];
+	ge_GIF *gif;
+	int i;
+	
+	for(i=0; i<16; ++i) {
+		uint8_t c = (i>=8 ? HALF_INTENSITY : FULL_INTENSITY);
+		palette[3*i + 0] = i&4 ? 0 : c;
+		palette[3*i + 1] = i&2 ? 0 : c;
+		palette[3*i + 2] = i&1 ? 0 : c;
+	}
+
+	gif = ge_new_gif(filename, 256, 256, palette, 4, -1, -1);
+	if(!gif) {perror(filename); return;}
+
+	if(pic->opt->verbose>1) {
+		printf("saving %s...", basename(filename));
+		fflush(stdout);
+	}
+	memcpy(gif->frame, pic->bitmap, sizeof(pic->bitmap));
+	ge_add_frame(gif, 0);
+	ge_close_gif(gif);
+}
+
+/* Resamples the source into pic->plane, the 256x256 linear colors 
+   the dithering reads. With hq_zoom, stb_image_resize first brings the 
+   source to about 256 pixels, straight to 16 bits linear. Then each 
+   squale pixel is the average of its area of the source (one pixel when
+   resized). The source is read once, a row at a time: each row is summed
+   over the 256 columns and added to the squale rows it belongs to, so 
+   that a streamed source only needs memory for one row (pic_load only
+   streams when stb_image_resize is not needed). The levels of 
+   --norm are measured during the same pass. The source is freed. */
+PRIVATE int pic_resample(pic *pic) {
+	const options *opt = pic->opt;
+	histogram *histo = NULL;
+	uint64_t (*acc)[256][3], s[256][3];	/* cells of any size */
+	uint16_t *buf;
+	uint8_t *rgb = NULL;
+	int i, k, x, y, ylo, ret = TRUE;
+	double t = mono_time();
+	
+	if(pic->sRGB && pic_zoom_size(pic, &x, &y)) {
+#ifdef STBIR_INCLUDE_STB_IMAGE_RESIZE2_H
+		uint16_t *lin = malloc(3*x*y*sizeof(*lin));
+		STBIR_RESIZE resize;
+			
+		stbir_resize_init(&resize, pic->sRGB, pic->w, pic->h, 0,
+			lin, x, y, 0, STBIR_RGB, STBIR_TYPE_UINT8_SRGB);
+		stbir_set_datatypes(&resize, STBIR_TYPE_UINT8_SRGB, STBIR_TYPE_UINT16);
+		if(lin && stbir_resize_extended(&resize)) {
+			pic->lin = lin;
+			pic->w = x;
+			pic->h = y;
+		} else free(lin);
+#endif
+	}
+	
+	for(i = 0; i < 256; ++i) {
+		int x1, y1, x2, y2;
+		
+		if((pic->w==256 && pic->w>=pic->h)
+		|| (pic->h==256 && pic->h>=pic->w)) {
+			squale_coord(pic, i, i, &x1, &y1);
+			x2 = x1+1; y2 = y1+1;
+		} else {
+			squale_coord(pic, i-1,i-1, &x1, &y1);
+			squale_coord(pic, i+1,i+1, &x2, &y2);
+			
+			++x1; if(x1>=x2) x2 = x1+1;
+			++y1; if(y1>=y2) y2 = y1+1;
+		}
+		
+		pic->box_x[0][i] = x1; pic->box_x[1][i] = x2;
+		pic->box_y[0][i] = y1; pic->box_y[1][i] = y2;
+	}
+	
+	if(opt->norm_b > 0 || opt->norm_w > 0) {
+		if(opt->verbose>1) printf("normalizing ");
+		histo = histogram_new();
+	}
+	
+	pic->plane = malloc(65536*sizeof(*pic->plane));
+	acc = calloc(256, sizeof(*acc));
+	buf = malloc(3*pic->w*sizeof(*buf));
+	if(pic->stream) rgb = malloc(3*pic->w);
+	if(!pic->plane || !acc || !buf || (pic->stream && !rgb)) 
+		OUT_OF_MEM((int)(65536*sizeof(*pic->plane) + 256*sizeof(*acc)));
+	
+	/* outside of the image is black */
+	for(k = ylo = 0; k < pic->h; ++k) {
+		const uint16_t *row;
+		int j = k;
+		
+		if(pic->stream) {
+			t = pic_stage(pic, STAGE_RESIZE, t);
+			j = pic_stream_row(pic->stream, rgb);
+			if(j < 0) {
+				FATAL("Error while loading: %s", pic->name, 0);
+				ret = FALSE;
+				break;
+			}
+			t = pic_stage(pic, STAGE_LOAD, t);
+			for(i = 0; i < 3*pic->w; ++i) buf[i] = sRGB2lin16(rgb[i]);
+			row = buf;
+		} else row = pic_row16(pic, j, buf);
+		
+		if(histo) {
+			t = pic_stage(pic, STAGE_RESIZE, t);
+			histogram_add_row(histo, row, pic->w);
+			t = pic_stage(pic, STAGE_NORM, t);
+		}
+		
+		for(x = 0; x < 256; ++x) {
+			s[x][0] = s[x][1] = s[x][2] = 0;
+			for(i = pic->box_x[0][x]; i < pic->box_x[1][x]; ++i) 
+			if(i >= 0 && i < pic->w) {
+				s[x][0] += row[3*i + 0];
+				s[x][1] += row[3*i + 1];
+				s[x][2] += row[3*i + 2];
+			}
+		}
+		
+		/* the areas are in increasing order */
+		if(pic->stream) ylo = 0;
+		while(ylo < 256 && pic->box_y[1][ylo] <= j) ++ylo;
+		for(y = ylo; y < 256 && pic->box_y[0][y] <= j; ++y) 
+		for(x = 0; x < 256; ++x) {
+			acc[y][x][0] += s[x][0];
+			acc[y][x][1] += s[x][1];
+			acc[y][x][2] += s[x][2];
+		}
+	}
+	
+	if(histo) {
+		t = pic_stage(pic, STAGE_RESIZE, t);
+		pic_norm(pic, histo, opt->norm_b, opt->norm_w);
+		free(histo);
+		t = pic_stage(pic, STAGE_NORM, t);
+	}
+	if(pic->norm_0 > 0) {
+		pic->norm_0x = 0.5f + pic->norm_0*65535;
+		pic->norm_1x = 0.5f + pic->norm_1*65536;
+	}
+	
+	for(y = 0; y < 256; ++y) for(x = 0; x < 256; ++x) {
+		const uint64_t n = (uint64_t)(pic->box_x[1][x] - pic->box_x[0][x])
+		                 * (pic->box_y[1][y] - pic->box_y[0][y]);
+		
+		STAT(&pic->wk->stats, samples, n);
+		for(k = 0; k < 3; ++k) {
+			int64_t t = (acc[y][x][k] + n/2)/n;
+			if(pic->norm_0 > 0) {
+				t = ((t - pic->norm_0x)*pic->norm_1x) >> 16;
+				t = t<=0 ? 0 : t>=65535 ? 65535 : t;
+			}
+			pic->plane[x + y*256][k] = t;
+		}
+	}
+	
+	STAT(&pic->wk->stats, pixels, 65536);
+	
+	free(rgb);
+	free(acc);
+	free(buf);
+	pic_stream_close(pic->stream); pic->stream = NULL;
+	free(pic->lin);  pic->lin  = NULL;
+	free(pic->sRGB); pic->sRGB = NULL;
+	if(!ret) {free(pic->plane); pic->plane = NULL;}
+	pic_stage(pic, STAGE_RESIZE, t);
+	
+	return ret;
+}
+
+/* linear color of squale pixel (x,y) on 16 bits */
+PRIVATE uint16_t *squale_color16(pic *pic, int x, int y, uint16_t *ret) {
+	const uint16_t *c = pic->plane[x + y*256];
+	ret[0] = c[0]; ret[1] = c[1]; ret[2] = c[2];
+	return ret;
+}
+
+PRIVATE vec3 *squale_color(pic *pic, int x, int y, vec3 *ret) {
+	uint16_t c[3];
+	return rgb16_vec3(squale_color16(pic, x, y, c), ret);
+}
+
+PRIVATE void pic_dither(pic *pic, int x, int y) {
+	uint16_t p[3]; 
+	
+	uint8_t c = dith(pic->wk, pic->opt->dith_descriptor, 
+	                 pic->opt->use_cache, x, y, 
+	  		 squale_color16(pic, x, y, p));
+	
+	pic->bitmap[x + y*256] = c; //*0+(((x/30)+(y/30))%14);
+}
+
+/* pixels in the order of the hilbert curve (filled by init). Any 
+   aligned run of 1024 pixels in there is a 32x32 block. */
+PRIVATE uint16_t hilbert_order[65536];
+
+struct hilbert {
+	unsigned int p, n;
+	int a, l, b;
+};
+
+PRIVATE void hilbert_walk(struct hilbert *h) {
+	static const int dir[] = {256,1,-256,-1};
+	if(h->l == 0) {
+		hilbert_order[h->n++] = h->p;
+	} else {
+		--h->l;
+		h->a -= (h->b=-h->b); 
+		hilbert_walk(h);
+		h->p = h->p + dir[h->a&3]; 
+		h->a -= (h->b=-h->b); 
+		hilbert_walk(h);
+		h->p = h->p + dir[h->a&3]; 
+		hilbert_walk(h);
+		h->a += (h->b=-h->b); 
+		h->p = h->p + dir[h->a&3]; 
+		hilbert_walk(h); 
+		h->a += (h->b=-h->b);		
+		++h->l;
+	}
+}
+
+// hilbert cuve improve cache hits
+PRIVATE void pic_conv_h(pic *pic) {
+	int i;
+	for(i=0;i<65536;++i) pic_dither(pic, hilbert_order[i] & 255, hilbert_order[i]>>8);
+}
+
+/* Row kernels: dith() on a whole scanline, the size of the matrix being
+   a constant so that the modulos become masks for the power-of-2 sizes.
+   There is one per matrix size of dith_descriptors[], and a generic one. */
+#define DITH_ROW(MX, MY, name)						\
+PRIVATE void name(pic *pic, const int y) {				\
+	const struct dith_descriptor *dith = pic->opt->dith_descriptor;	\
+	const int mx = (MX) ? (MX) : dith->mx, my = (MY) ? (MY) : dith->my;\
+	const uint8_t *row = dith->value + (y % my)*mx;			\
+	uint8_t *out = &pic->bitmap[y*256];				\
+	worker *wk = pic->wk;						\
+	int x;								\
+									\
+	if(pic->opt->use_cache == CACHE_LUT) for(x = 0; x < 256; ++x) {	\
+		uint16_t c[3];						\
+		const struct dith_lut *lut = 				\
+			dith_lut_entry(wk, dith, squale_color16(pic, x, y, c));\
+		out[x] = lut ? dith_lut_get(lut, row[x % mx]-1) : 7;	\
+	} else for(x = 0; x < 256; ++x) {				\
+		uint16_t c[3];						\
+		const uint8_t *value = dith_cache_entry(wk, dith, 	\
+			pic->opt->use_cache, squale_color16(pic, x, y, c));\
+		out[x] = value ? value[row[x % mx]-1] : 7;		\
+	}								\
+}
+
+DITH_ROW( 1,  1, dith_row_1x1)
+DITH_ROW( 2,  2, dith_row_2x2)
+DITH_ROW( 3,  3, dith_row_3x3)
+DITH_ROW( 4,  4, dith_row_4x4)
+DITH_ROW( 5,  5, dith_row_5x5)
+DITH_ROW( 6,  6, dith_row_6x6)
+DITH_ROW( 7,  7, dith_row_7x7)
+DITH_ROW( 8,  8, dith_row_8x8)
+DITH_ROW(18, 12, dith_row_18x12)
+DITH_ROW(30, 30, dith_row_30x30)
+DITH_ROW( 0,  0, dith_row_any)
+
+typedef void dith_row_fn(pic *, const int);
+
+PRIVATE const struct {
+	uint8_t mx, my;
+	dith_row_fn *row;
+} dith_rows[] = {
+	{ 1,  1, dith_row_1x1},
+	{ 2,  2, dith_row_2x2},
+	{ 3,  3, dith_row_3x3},
+	{ 4,  4, dith_row_4x4},
+	{ 5,  5, dith_row_5x5},
+	{ 6,  6, dith_row_6x6},
+	{ 7,  7, dith_row_7x7},
+	{ 8,  8, dith_row_8x8},
+	{18, 12, dith_row_18x12},
+	{30, 30, dith_row_30x30},
+};
+
+PRIVATE void pic_conv_l(pic *pic) {
+	const struct dith_descriptor *dith = pic->opt->dith_descriptor;
+	dith_row_fn *row = dith_row_any;
+	int i;
+	
+	for(i = 0; i < length_of(dith_rows); ++i)
+		if(dith_rows[i].mx == dith->mx && dith_rows[i].my == dith->my)
+			row = dith_rows[i].row;
+	
+	for(i = 0; i < 256; ++i) row(pic, i);
+}
+
+/* Threaded dithering. Letting each thread fill its own cache would make
+   the result depend on the way pixels are shared among threads, since 
+   an entry is computed from the first color reaching it. Instead, the
+   cache is extended in scan order by the calling thread, the new entries
+   are computed by the threads, and then the tiles are dithered from the
+   (now read-only) cache. The bitmap is thus the same as the serial one.
+   
+   Tiles are 1024 consecutive pixels in scan order: stripes of 4 lines,
+   or 32x32 blocks following the hilbert curve. */
+
+#define TILE_SIZE	1024
+#define MISS_CHUNK	256
+
+typedef struct tiles tiles;
+
+typedef struct tiles_thread {
+	tiles *t;
+	worker wk;
+	double busy;
+	pthread_t tid;
+} tiles_thread;
+
+struct tiles {
+	pic *pic;
+	const uint16_t *order;	/* scan order, NULL for linear */
+	vec3 *lin;		/* linear color of each pixel */
+	int32_t *entry;		/* cache key, then entry of each pixel, -1 for black */
+	int *miss;		/* pixel creating each new cache entry */
+	int first;		/* cache entry of miss[0] */
+	void (*job)(tiles *, worker *, int);
+	int items, next;
+	pthread_mutex_t lock;
+	tiles_thread *th;
+	int n;
+};
+
+PRIVATE void *tiles_thread_run(void *arg) {
+	tiles_thread *th = arg;
+	tiles *t = th->t;
+	double t0 = thread_time();
+	
+	for(;;) {
+		int i;
+		pthread_mutex_lock(&t->lock);
+		i = t->next++;
+		pthread_mutex_unlock(&t->lock);
+		if(i >= t->items) break;
+		t->job(t, &th->wk, i);
+	}
+	
+	th->busy += thread_time() - t0;
+	return NULL;
+}
+
+PRIVATE void tiles_run(tiles *t, void (*job)(tiles *, worker *, int), int items) {
+	int i;
+	
+	t->job   = job;
+	t->items = items;
+	t->next  = 0;
+	
+	for(i=0; i<t->n; ++i) {
+		if(pthread_create(&t->th[i].tid, NULL, tiles_thread_run, &t->th[i]))
+		FATAL("Can't create thread %d", i, -1);
+	}
+	for(i=0; i<t->n; ++i) pthread_join(t->th[i].tid, NULL);
+}
+
+PRIVATE void tiles_color(tiles *t, worker *wk, int tile) {
+	int i;
+	for(i = tile*TILE_SIZE; i < (tile+1)*TILE_SIZE; ++i) {
+		int p = t->order ? t->order[i] : i;
+		uint16_t c[3];
+		
+		squale_color16(t->pic, p & 255, p>>8, c);
+		t->entry[p] = dith_key(c);
+		dith_center(t->entry[p], &t->lin[p]);	/* for the misses */
+	}
+}
+
+PRIVATE void tiles_nocache(tiles *t, worker *wk, int tile) {
+	const struct dith_descriptor *dith = t->pic->opt->dith_descriptor;
+	struct tetra_hit hit[TILE_SIZE];
+	vec3 lin[TILE_SIZE], *pt[TILE_SIZE];
+	int i;
+	
+	for(i = 0; i < TILE_SIZE; ++i) {
+		int p = tile*TILE_SIZE + i;
+		if(t->order) p = t->order[p];
+		pt[i] = squale_color(t->pic, p & 255, p>>8, &lin[i]);
+	}
+	dith_find_batch(wk, TILE_SIZE, pt, hit);
+	
+	for(i = 0; i < TILE_SIZE; ++i) {
+		int p = tile*TILE_SIZE + i, x, y;
+		uint8_t value[DITH_MAX];
+		
+		if(t->order) p = t->order[p];
+		x = p & 255; y = p>>8;
+		dith_ramp(wk, dith, 0, pt[i], &hit[i], value);
+		t->pic->bitmap[p] = value[dith->value[(y % dith->my)*dith->mx + (x % dith->mx)]-1];
+	}
+}
+
+PRIVATE void tiles_miss(tiles *t, worker *wk, int chunk) {
+	const struct dith_descriptor *dith = t->pic->opt->dith_descriptor;
+	struct dith_cache *cache = t->pic->wk->dith_cache + t->first;
+	struct dith_lut *lut = t->pic->wk->dith_lut;
+	const int first = chunk*MISS_CHUNK;
+	int i, n = arrlen(t->miss) - first;
+	struct tetra_hit hit[MISS_CHUNK];
+	vec3 *pt[MISS_CHUNK];
+	
+	if(n > MISS_CHUNK) n = MISS_CHUNK;
+	for(i = 0; i < n; ++i) pt[i] = &t->lin[t->miss[first + i]];
+	dith_find_batch(wk, n, pt, hit);
+	
+	for(i = 0; i < n; ++i) {
+		int p = t->miss[first + i];
+		if(lut) {
+			uint8_t value[DITH_MAX];
+			dith_ramp(wk, dith, t->entry[p], pt[i], &hit[i], value);
+			dith_lut_set(&lut[t->entry[p]], value, dith->max);
+		} else dith_ramp(wk, dith, cache[first + i].key, pt[i], &hit[i], cache[first + i].value);
+	}
+}
+
+PRIVATE void tiles_dither(tiles *t, worker *wk, int tile) {
+	const struct dith_descriptor *dith = t->pic->opt->dith_descriptor;
+	const struct dith_cache *cache = t->pic->wk->dith_cache;
+	const struct dith_lut *lut = t->pic->wk->dith_lut;
+	int i;
+	for(i = tile*TILE_SIZE; i < (tile+1)*TILE_SIZE; ++i) {
+		int p = t->order ? t->order[i] : i, x = p & 255, y = p>>8;
+		int v = dith->value[(y % dith->my)*dith->mx + (x % dith->mx)]-1;
+		t->pic->bitmap[p] = t->entry[p] < 0 ? 7 : 
+			lut ? dith_lut_get(&lut[t->entry[p]], v) : 
+			      cache[t->entry[p]].value[v];
+	}
+}
+
+/* adds the missing cache entries in scan order, as dith() would do. 
+   The entry of a pixel is its key for the CACHE_LUT engine. */
+PRIVATE void tiles_fill_cache(tiles *t) {
+	worker *wk = t->pic->wk;
+	struct dith_lut *lut = t->pic->opt->use_cache == CACHE_LUT ? worker_lut(wk) : NULL;
+	int i;
+	
+	t->first = hmlen(wk->dith_cache);
+	for(i = 0; i < 65536; ++i) {
+		int p = t->order ? t->order[i] : i;
+		uint32_t key = t->entry[p];
+		int32_t e;
+		
+		if(key == 0) {t->entry[p] = -1; continue;}
+		
+		if(lut) {
+			if(!lut[key].valid) {
+				lut[key].valid = TRUE; /* filled by tiles_miss() */
+				++wk->dith_lut_len;
+				arrput(t->miss, p);
+			} else STAT(&wk->stats, dith_hit, 1);
+			STAT(&wk->stats, dith_total, 1);
+			t->entry[p] = key;
+			continue;
+		}
+		
+		e = hmgeti(wk->dith_cache, key);
+		if(e < 0) {
+			struct dith_cache new_entry;
+			new_entry.key = key;
+			hmputs(wk->dith_cache, new_entry);
+			e = hmgeti(wk->dith_cache, key);
+			assert(e == t->first + arrlen(t->miss));
+			arrput(t->miss, p);
+		} else STAT(&wk->stats, dith_hit, 1);
+		STAT(&wk->stats, dith_total, 1);
+		t->entry[p] = e;
+	}
+}
+
+PRIVATE void pic_conv_t(pic *pic) {
+	tiles t[1];
+	double wall = wall_time(), busy = 0;
+	int i;
+	
+	t->pic   = pic;
+	t->order = pic->opt->hilbert ? hilbert_order : NULL;
+	t->miss  = NULL;
+	t->n     = pic->opt->dith_threads > 1 ? pic->opt->dith_threads : 1;
+	t->th    = calloc(t->n, sizeof(*t->th));
+	if(!t->th) OUT_OF_MEM((int)(t->n*sizeof(*t->th)));
+	pthread_mutex_init(&t->lock, NULL);
+	for(i=0; i<t->n; ++i) {
+		t->th[i].t = t;
+		worker_init(&t->th[i].wk);
+	}
+	
+	if(!pic->opt->use_cache) {
+		tiles_run(t, tiles_nocache, 65536/TILE_SIZE);
+		STAT(&pic->wk->stats, dith_total, 65536);
+	} else {
+		t->lin   = malloc(65536*sizeof(*t->lin));
+		t->entry = malloc(65536*sizeof(*t->entry));
+		if(!t->lin || !t->entry) OUT_OF_MEM(65536*(int)(sizeof(*t->lin)+sizeof(*t->entry)));
+		
+		tiles_run(t, tiles_color, 65536/TILE_SIZE);
+		tiles_fill_cache(t);
+		tiles_run(t, tiles_miss, (arrlen(t->miss) + MISS_CHUNK-1)/MISS_CHUNK);
+		tiles_run(t, tiles_dither, 65536/TILE_SIZE);
+		
+		arrfree(t->miss);
+		free(t->entry);
+		free(t->lin);
+	}
+	
+	for(i=0; i<t->n; ++i) {
+		busy += t->th[i].busy;
+		stats_add(&pic->wk->stats, &t->th[i].wk.stats);
+		worker_flush(&t->th[i].wk);
+	}
+	wall = wall_time() - wall;
+	if(pic->opt->verbose>1) printf("dithered in %.1fms on %d threads (x%.1f)...", 
+		wall*1000, t->n, wall>0 ? busy/wall : 1);
+	
+	pthread_mutex_destroy(&t->lock);
+	free(t->th);
+}
+
+#if TETRA_GRID
+/* builds the candidate lists of the grid. The tetras of each cell are 
+   sorted by the number of sample points of the cell they contain. */
+PRIVATE void tetra_grid_init(worker *wk) {
+	const int n = length_of(tetras_desc), S = 3;
+	vec3 lo[length_of(tetras_desc)], hi[length_of(tetras_desc)];
+	int i, j, k, c;
+	
+	for(i = 0; i < n; ++i) for(k = 0; k < 3; ++k) {
+		lo[i][k] = hi[i][k] = wk->tetras[i].p[0]->pt[k];
+		for(j = 1; j < 4; ++j) {
+			float x = wk->tetras[i].p[j]->pt[k];
+			if(x < lo[i][k]) lo[i][k] = x;
+			if(x > hi[i][k]) hi[i][k] = x;
+		}
+	}
+	
+	for(c = 0; c < length_of(tetra_cell); ++c) {
+		int cnt[length_of(tetras_desc)];
+		vec3 c0, c1;
+		
+		c0[0] = (c/(TETRA_GRID*TETRA_GRID))/(float)TETRA_GRID;
+		c0[1] = ((c/TETRA_GRID)%TETRA_GRID)/(float)TETRA_GRID;
+		c0[2] = (c%TETRA_GRID)/(float)TETRA_GRID;
+		for(k = 0; k < 3; ++k) c1[k] = c0[k] + 1.0f/TETRA_GRID;
+		
+		tetra_cell[c].first = arrlen(tetra_cand);
+		tetra_cell[c].count = 0;
+		for(i = 0; i < n; ++i) {
+			for(k = 0; k < 3; ++k) 
+				if(lo[i][k] > c1[k] + TETRA_GRID_GAP
+				|| hi[i][k] < c0[k] - TETRA_GRID_GAP) break;
+			if(k < 3) continue;
+			
+			cnt[i] = 0;
+			for(j = 0; j < S*S*S; ++j) {
+				tetra *t = &wk->tetras[i];
+				vec3 p;
+				p[0] = c0[0] + (j/(S*S) + 0.5f)/(S*TETRA_GRID);
+				p[1] = c0[1] + ((j/S)%S + 0.5f)/(S*TETRA_GRID);
+				p[2] = c0[2] + (j%S     + 0.5f)/(S*TETRA_GRID);
+				tetra_coord(t, &p, NULL);
+				cnt[i] += t->p[0]->weight > DITH_EPS && t->p[1]->weight > DITH_EPS
+				       && t->p[2]->weight > DITH_EPS && t->p[3]->weight > DITH_EPS;
+			}
+			
+			/* insertion by decreasing count */
+			arrput(tetra_cand, i);
+			for(j = arrlen(tetra_cand)-1; j > tetra_cell[c].first 
+			    && cnt[tetra_cand[j-1]] < cnt[i]; --j)
+				tetra_cand[j] = tetra_cand[j-1];
+			tetra_cand[j] = i;
+			++tetra_cell[c].count;
+		}
+	}
+}
+#endif
+
+PRIVATE void init(void) {
+	struct hilbert h = {0, 0, 0, 8, 1};
+	int i;
+	
+	stbds_rand_seed(time(0));	
+	crc_init();
+	lin_init();
+	
+	/* png previews: stb globals, set once before any thread writes one */
+	stbi_write_force_png_filter = 0;
+	stbi_write_png_compression_level = 1024;
+	
+	worker_init(&main_worker);
+#if TETRA_GRID
+	tetra_grid_init(&main_worker);
+	tetra_soa_init(&main_worker);
+#endif
+	hilbert_walk(&h);
+	
+	for(i=0; dith_descriptors[i].name; ++i) 
+		dith_rescale(&dith_descriptors[i]);
+	
+	opt.dith_descriptor = dith_find("hex"); // this one seem pretty nice
+	opt.aspect_ratio = 1.0f;
+	opt.norm_w = opt.norm_b = -1.0f;
+}
+
+PRIVATE void usage(char *av0) {
+	int i;
+	
+	printf("Usage: %s [options] <image.ext> ...   (- reads stdin)\n", av0);
+	printf("options:\n");
+	printf(" ?, -h, --help : Prints this help\n");
+
+	printf(" -v             : Verbose\n");
+	printf(" -o <name>      : Specify output file "
+		"(accepted patterns: %%s, %%p, %%n, %%e, %%N, %%E, - for stdout)\n");
+	printf(" -x             : same as --o4\n");
+	printf(" -z             : same as --exo\n");
+	printf(" -r <w:h>       : same as --ratio\n");
+	printf(" -j <n>         : Converts the files on <n> threads\n");
+	printf(" -t <n>         : Dithers each image on <n> threads\n");
+	printf("\n");
+	
+	printf(" --exo          : Compresses with exomizer\n");
+	printf(" --zx0          : Compresses with ZX0/Salvador\n");
+	printf(" --span         : Horizontal runs drawn by the EF9365\n");
+	printf(" --best         : Keeps the smallest of raw, exomizer, ZX0 and spans\n");
+	printf(" --verify       : Decodes the files written as SQPSHOW would\n");
+	printf(" --decode-bench <n>: Same, decoding <n> times to measure the speed\n");
+	printf(" --target-time <s>: Chooses the compression of the smallest file\n");
+	printf("                  displayed by SQPSHOW in <s> seconds, or the fastest\n");
+	printf(" --gif          : Output gif image (for preview)\n");
+	printf(" --png          : Output png image (for preview)\n");
+	printf(" --pgm          : Output pgm image (for preview)\n");
+	printf(" --low          : Low quality resizing. Only this mode reads big\n");
+	printf("                  PPM/PGM/PAM/BMP a row at a time in bounded memory,\n");
+	printf("                  the default loads the whole image to resize it\n");
+	printf(" --ratio <w:h>  : Sets aspect ratio (default=1:1)\n");
+	printf(" --norm [<b:w>] : Normalize levels (typical=1.0:99.9)\n");
+	printf(" --no-cache     : Disable dither cache\n");
+	printf(" --lut          : Direct-indexed dither cache (less memory)\n");
+	printf(" --cache-file <f>: Keeps the dither solutions in <f> across runs\n");
+	printf(" --store <dir>  : Keeps the compressed files in <dir> across runs\n");
+	printf(" --incremental  : Skips the files whose output is up to date\n");
+	printf(" --optimize-size [<d1,d2...>]: Tries the dithers (default: same size)\n");
+	printf("                  and their phases for the smallest compressed size\n");
+	printf("                  (with --exo, --zx0, --span or --best)\n");
+	printf(" --hilbert      : Dither along a hilbert curve (32x32 tiles with -t)\n");
+	printf(" --search-time <s>   : Races compressor settings for <s> seconds at most\n");
+	printf("                       (0: the default settings only)\n");
+	printf(" --search-threads <n>: Races compressor settings on <n> threads\n");
+#if SQPIX_STATS
+	printf(" --stats <f>    : Writes the counters of each image to <f> (json)\n");
+#endif
+	printf(" --serve <s>    : Converts the requests of clients on the unix socket\n");
+	printf("                  <s>, or on stdin/stdout with \"-\" (see sqpix.c)\n");
+	printf(" --bench <f>    : Times the stages of every dither and compression\n");
+	printf("                  of the files, writing the results to <f> (json, csv)\n");
+	printf(" --bench-runs <n>    : Keeps the median of <n> runs (default=3)\n");
+	printf(" --bench-baseline <f>: Reports the stages slower than in <f>\n");
+	printf("\n");
+	
+	for(i=0; dith_descriptors[i].name; ++i)
+	printf(" --%-12s : %s\n", dith_descriptors[i].name, dith_descriptors[i].desc);
+	
+	exit(0);
+}
+
+/* the errors of the command-line are fatal, the ones of the requests 
+   of --serve and of sqpix_options() are kept in parse_error, parse() 
+   returning -1 */
+#define PARSE_ERROR(fmt, value) do {					\
+	if(!parse_soft) FATAL(fmt, value, -1);				\
+	snprintf(parse_error, sizeof(parse_error), fmt, value);		\
+	return -1;							\
+	} while(0)
+
+PRIVATE int parse(int i, int ac, char **av) {
+	for(input_file = NULL; i<ac && input_file==NULL; ++i) {
+		if(!strcmp("?", av[i])
+		|| !strcmp("-h", av[i])
+		|| !strcmp("--help", av[i])
+		|| 0) {
+			if(parse_soft) PARSE_ERROR("Unknown argument: %s", av[i]);
+			usage(av[0]);
+		}
+
+		else if(!strcmp("-v", av[i])) 
+			opt.verbose = 1;
+		else if(!strcmp("--debug", av[i])) 
+			opt.verbose = 2;
+		else if(!strcmp("-o", av[i]) && i<ac-1)
+			opt.output_file = av[++i];
+		else if(!strcmp("-j", av[i]) && i<ac-1)
+			threads = atoi(av[++i]);
+		else if(!strcmp("-t", av[i]) && i<ac-1) {
+			int n = atoi(av[++i]);
+			opt.dith_threads = n<0 ? 0 : n>255 ? 255 : n;
+		}
+		else if(!strcmp("--hilbert", av[i])) 
+			opt.hilbert = TRUE;
+		else if(!strcmp("--search-time", av[i]) && i<ac-1) {
+			opt.search_time = atof(av[++i]);
+			if(opt.search_time < 0) opt.search_time = 0;
+		}
+		else if(!strcmp("--search-threads", av[i]) && i<ac-1) {
+			int n = atoi(av[++i]);
+			opt.search_threads = n<0 ? 0 : n>255 ? 255 : n;
+		}
+		else if(!strcmp("-x", av[i])) 
+			opt.dith_descriptor = dith_find("o4");
+		else if(!strcmp("--no-cache", av[i])) 
+			opt.use_cache = CACHE_NONE;
+		else if(!strcmp("--lut", av[i])) 
+			opt.use_cache = CACHE_LUT;
+		else if(!strcmp("--cache-file", av[i]) && i<ac-1)
+			cache_file = av[++i];
+		else if(!strcmp("--store", av[i]) && i<ac-1)
+			store_dir = av[++i];
+		else if(!strcmp("--incremental", av[i])) 
+			opt.incremental = TRUE;
+		else if(!strcmp("--optimize-size", av[i])) {
+			/* optional list of dithers, if it starts with one */
+			const char *s = i<ac-1 ? av[i+1] : NULL, *e;
+			char name[16];
+			int l;
+			
+			opt.optimize_size = "";
+			for(; s; s = e ? e + 1 : NULL) {
+				e = strchr(s, ',');
+				l = e ? (int)(e - s) : (int)strlen(s);
+				if(l >= (int)sizeof(name)) break;
+				memcpy(name, s, l); name[l] = '\0';
+				if(!dith_find(name)) {
+					if(*opt.optimize_size) 
+					PARSE_ERROR("Unknown dither: %s", name);
+					break;
+				}
+				if(!*opt.optimize_size) opt.optimize_size = av[++i];
+			}
+		}
+		else if(!strcmp("--exo", av[i])
+                     || !strcmp("-z",   av[i]))
+			opt.exo = TRUE;
+		else if(!strcmp("--zx0", av[i]))
+			opt.zx0 = TRUE;
+		else if(!strcmp("--span", av[i]))
+			opt.span = TRUE;
+		else if(!strcmp("--best", av[i]))
+			opt.best = TRUE;
+		else if(!strcmp("--verify", av[i]))
+			opt.verify = TRUE;
+		else if(!strcmp("--decode-bench", av[i]) && i<ac-1)
+			opt.decode_bench = atoi(av[++i]);
+		else if(!strcmp("--target-time", av[i]) && i<ac-1)
+			opt.target_time = atof(av[++i]);
+#if SQPIX_STATS
+		else if(!strcmp("--stats", av[i]) && i<ac-1)
+			stats_file = av[++i];
+#else
+		else if(!strcmp("--stats", av[i]))
+			PARSE_ERROR("%s: this build has no counters (SQPIX_STATS=0)", av[i]);
+#endif
+		else if(!strcmp("--serve", av[i]) && i<ac-1)
+			serve_path = av[++i];
+		else if(!strcmp("--bench", av[i]) && i<ac-1)
+			bench_file = av[++i];
+		else if(!strcmp("--bench-runs", av[i]) && i<ac-1)
+			bench_runs = atoi(av[++i]);
+		else if(!strcmp("--bench-baseline", av[i]) && i<ac-1)
+			bench_baseline = av[++i];
+		else if(!strcmp("--pgm", av[i])) 
+			opt.pgm = TRUE;
+		else if(!strcmp("--png", av[i])) 
+			opt.png = TRUE;
+		else if(!strcmp("--gif", av[i])) 
+			opt.gif = TRUE;
+		else if(!strcmp("--low", av[i])) 
+			opt.hq_zoom = FALSE;
+		else if(!strcmp("--norm", av[i])) {
+			char *s = i<ac-1 ? av[i+1] : NULL;
+			float x = -1, y = -1;
+			if(s && 2==sscanf(s, "%f:%f", &x, &y)) {++i;}   else
+			if(s && 1==sscanf(s, ":%f", &y)) {x = -1; ++i;} else
+			if(s && 1==sscanf(s, "%f:", &x)) {y = -1; ++i;}
+			else {x = 1.0f; y = 99.9f;}
+			opt.norm_b = x< 0 || x>=100 ? -1 : x/100.0f;
+			opt.norm_w = y<=0 || y> 100 ? -1 : y/100.0f;
+			if(0 <= opt.norm_w && opt.norm_w <= opt.norm_b) opt.norm_b = opt.norm_w = -1;
+		} 
+		else if(i<ac-1 && (
+			 !strcmp("--ratio", av[i]) ||
+			 !strcmp("-r", av[i])
+			 )) {
+			char *s = av[++i];		
+			float x,y;
+			if(sscanf(s, "%f:%f", &x, &y) != 2) {
+				y = 1.0f;
+				if(sscanf(s,"%f", &x) != 1) {
+					x = y = -1.0f;
+				}
+			}
+			if(y<=0) PARSE_ERROR("Invalid ratio: %s", av[i]);
+			opt.aspect_ratio = fabsf(x/y);
+		} 
+		else if(!strncmp("--", av[i], 2)) {
+			opt.dith_descriptor = dith_find(av[i]+2);
+			if(!opt.dith_descriptor) PARSE_ERROR("Unknown dither: --%s", av[i]+2);
+		}
+		else if(parse_soft && *av[i] == '@') 
+			input_file = av[i];	/* bytes of the request */
+		else if(!parse_soft && !strcmp(av[i], "-")) {
+			if(!membuf_get(&stdin_buf) && !read_stdin()) 
+				FATAL("Can't read %s", "stdin", -1);
+			input_file = av[i];
+		}
+		else if(*av[i] != '-') {
+			FILE *f = fopen(av[i], "rb");
+			if(f) {fclose(f); input_file = av[i];}
+			else perror(av[i]);
+		}
+		else PARSE_ERROR("Unknown argument: %s", av[i]);
+	}
+	/* nothing to optimize in an uncompressed file */
+	if(input_file && opt.optimize_size 
+	&& !(opt.exo || opt.zx0 || opt.span || opt.best))
+		PARSE_ERROR("--optimize-size needs --exo, --zx0, --span or --best: %s", 
+			input_file);
+	if(input_file == NULL && !parse_soft && !serve_path) 
+		FATAL("Missing file after : %s", av[ac-1], -1);
+	return i;
+}
+
+/* dithers the whole picture with the engine matching the options 
+   (without cache, the tiles allow the batched search) */
+PRIVATE void pic_dither_all(pic *pic) {
+	const options *opt = pic->opt;
+	
+	if(opt->dith_threads > 1 || !opt->use_cache) pic_conv_t(pic);
+	else if(opt->hilbert) pic_conv_h(pic);
+	else pic_conv_l(pic);
+}
+
+/* --optimize-size: dithers with each matrix of the list and each phase 
+   of the matrix, keeping the bitmap of smallest estimated compressed
+   size (the exact one for the spans). Phases are tried as shifted 
+   copies of the matrix, sampled when there are more than 
+   OPTIMIZE_PHASES of them. The ramps don't depend on the phase, so the
+   cache is only flushed when changing of matrix. */
+#define OPTIMIZE_PHASES	64
+
+PRIVATE void pic_optimize(pic *pic) {
+	const options *opt = pic->opt;
+	struct dith_descriptor *list[length_of(dith_descriptors)];
+	uint8_t *best = malloc(65536), *in = malloc(65536);
+	int i, n = 0, best_size = -1, tries = 0;
+	struct membuf spans;
+	options o = *opt;
+	
+	if(!best || !in) OUT_OF_MEM(2*65536);
+	membuf_init(&spans);
+	
+	/* the selected matrix first, for the ties */
+	list[n++] = opt->dith_descriptor;
+	for(i = 0; dith_descriptors[i].name; ++i) {
+		struct dith_descriptor *d = &dith_descriptors[i];
+		const char *s = opt->optimize_size;
+		int l = strlen(d->name), ok;
+		
+		if(d == opt->dith_descriptor) continue;
+		if(*s == '\0') ok = d->mx == list[0]->mx && d->my == list[0]->my;
+		else for(ok = FALSE; !ok && s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL)
+			ok = !strncmp(s, d->name, l) && (s[l] == ',' || s[l] == '\0');
+		if(ok) list[n++] = d;
+	}
+	
+	pic->opt = &o;
+	for(i = 0; i < n; ++i) {
+		struct dith_descriptor shifted = *list[i];
+		const int mx = shifted.mx, my = shifted.my, m = mx*my;
+		const int phases = m < OPTIMIZE_PHASES ? m : OPTIMIZE_PHASES;
+		int k;
+		
+		shifted.value = malloc(m);
+		if(!shifted.value) OUT_OF_MEM(m);
+		o.dith_descriptor = &shifted;
+		/* the ramps in cache are the ones of another matrix */
+		worker_flush(pic->wk);
+		
+		for(k = 0; k < phases; ++k) {
+			const int ph = k*m/phases, ox = ph % mx, oy = ph / mx;
+			int x, y, size;
+			
+			for(y = 0; y < my; ++y) for(x = 0; x < mx; ++x)
+				shifted.value[y*mx + x] = 
+				list[i]->value[((y+oy) % my)*mx + (x+ox) % mx];
+			
+			pic_dither_all(pic);
+			if(opt->span && !opt->exo && !opt->zx0 && !opt->best) {
+				membuf_clear(&spans);
+				encode_spans(pic->bitmap, &spans);
+				size = membuf_memlen(&spans);
+			} else {
+				pic_encoder_input(pic, opt->zx0, in);
+				size = lz_estimate(in, 65536);
+			}
+			++tries;
+			
+			if(best_size < 0 || size < best_size) {
+				best_size = size;
+				memcpy(best, pic->bitmap, 65536);
+				if(opt->verbose > 1) printf("%s+%d,%d ~%d bytes...", 
+					list[i]->name, ox, oy, size);
+			}
+		}
+		free(shifted.value);
+	}
+	pic->opt = opt;
+	worker_flush(pic->wk);	/* for the next image */
+	
+	if(opt->verbose > 1) printf("%d tried...", tries);
+	memcpy(pic->bitmap, best, 65536);
+	membuf_free(&spans);
+	free(best);
+	free(in);
+}
+
+/* loads, normalizes, dithers and compresses the image. Nothing is
+   written, so this part can be run by any worker. */
+PRIVATE int pic_convert(pic *pic, const char *filename) {
+	const options *opt = pic->opt;
+	worker *wk = pic->wk;
+	double t = mono_time();
+	
+	memset(&wk->stats, 0, sizeof(wk->stats));
+	if(!pic_load(pic, filename)) return FALSE;
+	pic_stage(pic, STAGE_LOAD, t);
+	
+	if(!pic_resample(pic)) return FALSE;
+	
+	// convert
+	t = mono_time();
+	if(opt->optimize_size && (opt->exo || opt->zx0 || opt->span || opt->best)) 
+		pic_optimize(pic);
+	else pic_dither_all(pic);
+	pic_stage(pic, STAGE_DITHER, t);
+	if(opt->verbose > 1 && opt->use_cache) {
+		printf("%d cache entries (%dkb", worker_cache_len(wk),
+			(int)(hmlen(wk->dith_cache)*sizeof(*wk->dith_cache) +
+			      wk->dith_lut_len*sizeof(*wk->dith_lut))/1024);
+#if SQPIX_STATS
+		printf(", %.1f%%", 100*wk->stats.dith_hit/wk->stats.dith_total);
+#endif
+		printf(")...");
+	}
+#if SQPIX_STATS
+	if(opt->verbose > 1 && wk->stats.tetra_miss) printf("%.2f tetras/miss...",
+		wk->stats.tetra_tested/wk->stats.tetra_miss);
+#endif
+	
+	t = mono_time();
+	pic_encode(pic);
+	pic_stage(pic, STAGE_COMPRESS, t);
+	pic->stats = wk->stats;
+	
+	return TRUE;
+}
+
+/* Manifests (--incremental): next to each output is written a small
+   text file with the version of sqpix, the path and CRC-64 of the input 
+   file and the CRC-64 of the options changing the output. When it 
+   matches, the input is skipped without even being decoded. When only
+   the path matches, the output is replaced rather than %N renamed. */
+#ifndef SQPIX_VERSION
+#define SQPIX_VERSION	__DATE__ " " __TIME__
+#endif
 
+PRIVATE uint64_t file_crc64(const char *filename) {
+	uint64_t crc = 0;
+	uint8_t buf[65536];
+	size_t n;
+	FILE *f;
+	
+	if(!strcmp(filename, "-")) 
+		return crc64(0, membuf_get(&stdin_buf), membuf_memlen(&stdin_buf));
+	if((f = fopen(filename, "rb")) == NULL) return 0;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) crc = crc64(crc, buf, n);
 	fclose(f);
+	
+	return crc;
+}
+
+PRIVATE char *manifest(const options *opt, const char *filename, 
+                       uint64_t src_crc) {
+	char s[256], *ret;
+	int n;
+	
+	/* everything but the verbosity and the name of the output */
+	snprintf(s, sizeof(s), "%s %g %g %g %d%d%d%d%d %d%d%d %d%d%d%d %d %g",
+		opt->dith_descriptor->name, opt->aspect_ratio, 
+		opt->norm_b, opt->norm_w, 
+		opt->exo, opt->zx0, opt->span, opt->best, opt->use_cache,
+		opt->pgm, opt->png, opt->gif, 
+		opt->centered, opt->hq_zoom, opt->hilbert, opt->dith_threads>1,
+		opt->search_threads, opt->search_time);
+	if(opt->optimize_size) {
+		int l = strlen(s);
+		snprintf(s + l, sizeof(s) - l, " %s", opt->optimize_size);
+	}
+	if(opt->target_time >= 0) {
+		int l = strlen(s);
+		snprintf(s + l, sizeof(s) - l, " t%g", opt->target_time);
+	}
+	
+	n = strlen(SQPIX_VERSION) + strlen(filename) + 128;
+	ret = malloc(n);
+	if(!ret) OUT_OF_MEM(n);
+	sprintf(ret, "sqpix %s\nsource %s\ninput %016llx\noptions %016llx\n", 
+		SQPIX_VERSION, filename, (unsigned long long)src_crc, 
+		(unsigned long long)crc64(0, s, strlen(s)));
+	
+	return ret;
+}
+
+/* tells if the output of filename is current, remembering the CRC of
+   the input for pic_commit() */
+PRIVATE int pic_uptodate(pic *pic, const char *filename) {
+	const options *opt = pic->opt;
+	const char *out, *mf;
+	char *expected, *buf;
+	int ok = FALSE, l;
+	FILE *f;
+	
+	pic->src_crc = 0;
+	pic->replace = FALSE;
+	if(!opt->incremental) return FALSE;
+	
+	pic->src_crc = file_crc64(filename);
+	out = path_format(opt->output_file, filename);
+	mf  = path_format("%s.mf", out);
+	expected = manifest(opt, filename, pic->src_crc);
+	l = strlen(expected) + 1;
+	buf = malloc(l);
+	if(!buf) OUT_OF_MEM(l);
+	
+	f = fopen(out, "rb");
+	if(f) {
+		fclose(f);
+		f = fopen(mf, "rb");
+	}
+	if(f) {
+		size_t n = fread(buf, 1, l-1, f);
+		const char *a, *b = strchr(expected, '\n');
+		
+		buf[n] = '\0';
+		a = strchr(buf, '\n');
+		
+		/* same "source" line */
+		pic->replace = a && !strncmp(a, b, strchr(b+1, '\n') - b + 1);
+		ok = getc(f) == EOF && !strcmp(buf, expected);
+		fclose(f);
+	}
+	
+	free(buf);
+	free(expected);
+	free((void*)mf);
+	free((void*)out);
+	
+	return ok;
+}
+
+PRIVATE void pic_save_manifest(pic *pic, const char *filename) {
+	char *s = manifest(pic->opt, pic->name, pic->src_crc);
+	write_file(filename, s, strlen(s));
+	free(s);
+}
+
+/* writes s as a JSON string */
+PRIVATE void json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for(; *s; ++s) {
+		if(*s == '"' || *s == '\\') fputc('\\', f);
+		if((uint8_t)*s < 32) fprintf(f, "\\u%04x", *s);
+		else fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* --stats: one JSON record per line telling where the time went */
+PRIVATE void pic_save_stats(pic *pic, FILE *f, const char *filename, 
+                            const char *out) {
+	const stats *st = &pic->stats;
+	double total = 0;
+	int k;
+	
+	fprintf(f, "{\"file\":");
+	json_string(f, filename);
+	fprintf(f, ",\"output\":");
+	json_string(f, out);
+	fprintf(f, ",\"bytes\":%d", pic->saved_size);
+	for(k = 0; k < STAGES; ++k) {
+		fprintf(f, ",\"%s_ms\":%.3f", stage_names[k], 1000*pic->stage_time[k]);
+		total += pic->stage_time[k];
+	}
+	fprintf(f, ",\"total_ms\":%.3f", 1000*total);
+	fprintf(f, ",\"cache_probes\":%.0f,\"cache_misses\":%.0f",
+		st->dith_total, st->dith_total - st->dith_hit);
+	fprintf(f, ",\"tetra_searches\":%.0f,\"tetras_per_search\":%.2f",
+		st->tetra_miss, st->tetra_miss ? st->tetra_tested/st->tetra_miss : 0);
+	fprintf(f, ",\"lru_reorders\":%.0f,\"proj2\":%.0f,\"proj3\":%.0f",
+		st->tetra_moves, st->proj2, st->proj3);
+	fprintf(f, ",\"samples_per_pixel\":%.2f", 
+		st->pixels ? st->samples/st->pixels : 0);
+	fprintf(f, ",\"compressed_in\":%.0f,\"compressed_out\":%.0f}\n",
+		st->comp_in, st->comp_out);
+	fflush(f);
+}
+
+/* chooses the output name and writes the files. This must be done in
+   the order of the command-line for the %N renaming to be reproducible. */
+PRIVATE void pic_commit(pic *pic, const char *filename) {
+	const options *opt = pic->opt;
+	const char *out;
+	double t = mono_time();
+	
+	out = path_format(opt->output_file, filename);
+	if(strstr(opt->output_file, "%N") != NULL && !pic->replace) {
+		FILE *f = fopen(out, "rb");
+		if(f) { fclose(f);
+			int32_t crc = (pic->plane ? pic_crc32(pic) : pic->crc) % 1291;
+			int n = strlen(out), l = n+3;
+			char *tmp = malloc(l); if(!tmp) OUT_OF_MEM(l);
+			strcpy(tmp, out);
+							
+			while(n>0 && tmp[n-1]!='/' && tmp[n-1]!='\\') --n;
+			for(l=0; tmp[n+l] && tmp[n+l]!='.'; ++l);
+			
+			if(l<8) {
+				int l2 = l;
+				
+				tmp[n + l++] = ' '; 
+				if(l<8) tmp[n + l++] = ' '; 
+				
+				strcpy(tmp + n + l, out + n + l2);
+			}
+			n += l-2;
+			l = crc%36; crc/=36; tmp[n++] = l<10? '0'+l : 'A'+l-10;
+			l = crc%36; crc/=36; tmp[n++] = l<10? '0'+l : 'A'+l-10;
+			free((void*)out);
+			out = tmp;
+		}
+	}
+
+	// overview
+	if(opt->pgm) {
+		const char *s = path_format("%s.pgm", out);
+		pic_save_pgm(pic, s);
+		free((void*)s);
+	}
+	if(opt->png) {
+		const char *s = path_format("%s.png", out);
+		pic_save_png(pic, s);
+		free((void*)s);
+	}
+	if(opt->gif) {
+		const char *s = path_format("%s.gif", out);
+		pic_save_gif(pic, s);
+		free((void*)s);
+	}
+	
+	// save
+	pic_save(pic, out);
+	pic_stage(pic, STAGE_WRITE, t);
+#if SQPIX_STATS
+	if(stats_out) pic_save_stats(pic, stats_out, filename, out);
+#endif
+	if(opt->verify || opt->decode_bench > 0) pic_verify(pic, out);
+	if(opt->incremental) {
+		const char *s = path_format("%s.mf", out);
+		pic_save_manifest(pic, s);
+		free((void*)s);
+	}
+	
+	// done
+	pic_done(pic);
+	free((void*)out);
+}
+
+typedef struct job {
+	char *input_file;
+	options opt;
+	uint8_t verbose;
+	uint8_t done, skipped;
+	pic *pic;
+} job;
+
+PRIVATE job *jobs;
+PRIVATE int jobs_next;
+PRIVATE pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE pthread_cond_t  jobs_cond = PTHREAD_COND_INITIALIZER;
+
+PRIVATE void *job_thread(void *arg) {
+	worker *wk = calloc(1, sizeof(*wk));
+	if(!wk) OUT_OF_MEM((int)sizeof(*wk));
+	
+	for(;;) {
+		job *job = NULL;
+		pic *pic;
+		
+		pthread_mutex_lock(&jobs_lock);
+		if(jobs_next < arrlen(jobs)) job = &jobs[jobs_next++];
+		pthread_mutex_unlock(&jobs_lock);
+		if(job == NULL) break;
+		
+		pic = malloc(sizeof(*pic));
+		if(!pic) OUT_OF_MEM((int)sizeof(*pic));
+		pic->opt = &job->opt;
+		pic->wk  = wk;
+		pic->src = NULL;
+		
+		/* start from scratch so that the result does not depend 
+		   on the files previously converted by this thread */
+		worker_init(wk);
+		if(pic_uptodate(pic, job->input_file)) {
+			job->skipped = TRUE;
+			free(pic);
+			pic = NULL;
+		} else if(pic_convert(pic, job->input_file)) {
+			if(strstr(job->opt.output_file, "%N") != NULL) 
+				pic->crc = pic_crc32(pic);
+			free(pic->plane);
+			pic->plane = NULL;
+		} else {
+			free(pic);
+			pic = NULL;
+		}
+		
+		pthread_mutex_lock(&jobs_lock);
+		job->pic  = pic;
+		job->done = TRUE;
+		pthread_cond_broadcast(&jobs_cond);
+		pthread_mutex_unlock(&jobs_lock);
+	}
+	
+	worker_flush(wk);
+	free(wk);
+	
+	return arg;
+}
+
+/* converts the jobs on a pool of threads. The files are written by
+   the main thread as soon as all preceding files are written. */
+PRIVATE void run_jobs(int n) {
+	pthread_t *tid;
+	int i;
+	
+	if(n > arrlen(jobs)) n = arrlen(jobs);
+	tid = malloc(n*sizeof(*tid));
+	if(!tid) OUT_OF_MEM((int)(n*sizeof(*tid)));
+	
+	for(i=0; i<n; ++i) {
+		if(pthread_create(&tid[i], NULL, job_thread, NULL))
+		FATAL("Can't create thread %d", i, -1);
+	}
+	
+	for(i=0; i<arrlen(jobs); ++i) {
+		job *job = &jobs[i];
+		
+		pthread_mutex_lock(&jobs_lock);
+		while(!job->done) pthread_cond_wait(&jobs_cond, &jobs_lock);
+		pthread_mutex_unlock(&jobs_lock);
+		
+		if(job->pic) {
+			job->opt.verbose = job->verbose;
+			if(job->verbose) {
+				printf("%s...", basename(job->input_file));
+				fflush(stdout);
+			}
+			pic_commit(job->pic, job->input_file);
+			free(job->pic);
+		} else if(job->skipped && job->verbose) 
+			printf("%s...up to date\n", basename(job->input_file));
+	}
+	
+	for(i=0; i<n; ++i) pthread_join(tid[i], NULL);
+	free(tid);
+}
+
+/* --bench: each input is converted with every dither and every SQP
+   version, bench_runs times, timing the stages. The medians are written
+   to bench_file (CSV if it ends with ".csv", JSON otherwise) and, if 
+   given, compared to those of bench_baseline, a previous bench_file. 
+   Stages taking BENCH_TOLERANCE percent more time than in the baseline
+   are reported as regressions, unless too short to be measured. */
+#define BENCH_TOLERANCE		10	/* % */
+#define BENCH_MIN_MS		2.0
+
+PRIVATE const struct {const char *name; int version;} bench_formats[] = {
+	{"raw", SQP_RAW}, {"exo", SQP_EXO}, {"zx0", SQP_ZX0}, {"span", SQP_SPAN}
+};
+
+typedef struct bench_rec {
+	char file[256], dither[16], format[8];
+	int runs, bytes;
+	double ms[STAGES + 1];		/* stages and total */
+} bench_rec;
+
+PRIVATE int bench_cmp_double(const void *a, const void *b) {
+	const double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+PRIVATE void bench_write(FILE *f, const int csv, const bench_rec *r, const int first) {
+	int k;
+	
+	if(csv) {
+		if(first) {
+			fprintf(f, "file,dith,format,runs,bytes");
+			for(k = 0; k < STAGES; ++k) fprintf(f, ",%s", stage_names[k]);
+			fprintf(f, ",total\n");
+		}
+		/* the name quoted, its quotes doubled */
+		fputc('"', f);
+		for(k = 0; r->file[k]; ++k) {
+			if(r->file[k] == '"') fputc('"', f);
+			fputc(r->file[k], f);
+		}
+		fprintf(f, "\",%s,%s,%d,%d", r->dither, r->format, r->runs, r->bytes);
+		for(k = 0; k <= STAGES; ++k) fprintf(f, ",%.3f", r->ms[k]);
+		fprintf(f, "\n");
+	} else {
+		fprintf(f, "%s{\"file\":", first ? "[\n" : ",\n");
+		json_string(f, r->file);
+		fprintf(f, ",\"dith\":\"%s\",\"format\":\"%s\",\"runs\":%d,\"bytes\":%d", 
+			r->dither, r->format, r->runs, r->bytes);
+		for(k = 0; k < STAGES; ++k) fprintf(f, ",\"%s\":%.3f", stage_names[k], r->ms[k]);
+		fprintf(f, ",\"total\":%.3f}", r->ms[STAGES]);
+	}
+}
+
+/* cuts the next value of a record of bench_write() in place, skipping
+   its separator: a quoted string, with the escapes of json_string() or 
+   the doubled quotes of CSV, or else up to the next separator */
+PRIVATE char *bench_value(char **s, const int csv) {
+	char *p = *s, *ret = p, *d;
+	
+	if(*p == '"') {
+		ret = d = ++p;
+		while(*p && (*p != '"' || (csv && p[1] == '"'))) {
+			if(*p == '"') {*d++ = '"'; p += 2;}
+			else if(!csv && p[0] == '\\' && p[1] == 'u' && strlen(p) >= 6) {
+				char hex[5] = {p[2], p[3], p[4], p[5], '\0'};
+				*d++ = strtol(hex, NULL, 16);
+				p += 6;
+			}
+			else if(!csv && p[0] == '\\' && p[1]) {*d++ = p[1]; p += 2;}
+			else *d++ = *p++;
+		}
+		if(*p == '"') ++p;
+		*d = '\0';
+	} else p += strcspn(p, csv ? "," : ",}");
+	if(*p) *p++ = '\0';
+	*s = p;
+	
+	return ret;
 }
 
-PRIVATE void pic_save_pgm(pic *pic, const char *filename) {
-	FILE *f = fopen(filename, "wt");
-	int i;
+/* reads back a record of bench_write(), in either format */
+PRIVATE int bench_parse(char *line, bench_rec *r) {
+	char *v[5 + STAGES + 1], *s = line;
+	int n = 0, k;
 	
-	if(f==NULL) {
-		perror(filename);
-		return;
-	}
+	if(*s == ',') ++s;
+	if(*s == '{') {
+		/* "key":value pairs, the keys being in order */
+		for(++s; n < (int)length_of(v) && *s == '"'; ++n) {
+			bench_value(&s, FALSE);
+			v[n] = bench_value(&s, FALSE);
+		}
+	} else for(; n < (int)length_of(v) && *s; ++n) 
+		v[n] = bench_value(&s, TRUE);
+	if(n < (int)length_of(v) || !strcmp(v[0], "file")) return FALSE;
 	
-	if(verbose>1) {
-		printf("saving %s...", basename(filename));
-		fflush(stdout);
-	}
+	snprintf(r->file,   sizeof(r->file),   "%s", v[0]);
+	snprintf(r->dither, sizeof(r->dither), "%s", v[1]);
+	snprintf(r->format, sizeof(r->format), "%s", v[2]);
+	r->runs  = atoi(v[3]);
+	r->bytes = atoi(v[4]);
+	for(k = 0; k <= STAGES; ++k) r->ms[k] = atof(v[5 + k]);
 	
-	fprintf(f, "P3\n256 256\n255\n");
-	for(i=0;i<65536;++i) {
-		int c = pic->bitmap[i]>=8 ? HALF_INTENSITY : FULL_INTENSITY;
-		fprintf(f, "%d %d %d\n", 
-			pic->bitmap[i] & 4 ? 0 : c,
-			pic->bitmap[i] & 2 ? 0 : c,
-			pic->bitmap[i] & 1 ? 0 : c);
+	return TRUE;
+}
+
+PRIVATE bench_rec *bench_load(const char *filename) {
+	bench_rec *recs = NULL, r;
+	char line[1024];
+	FILE *f = fopen(filename, "r");
+	
+	if(f == NULL) {perror(filename); return NULL;}
+	while(fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if(bench_parse(line, &r)) arrput(recs, r);
 	}
 	fclose(f);
+	
+	return recs;
 }
 
-PRIVATE void pic_save_png(pic *pic, const char *filename) {
-	FILE *f = fopen(filename, "wt");
-	uint8_t *buf = malloc(3*256*256), *rgb = buf;
-	int i;
+/* prints the stages slower than in the baseline, returns their number */
+PRIVATE int bench_compare(const bench_rec *r, const bench_rec *base) {
+	int i, k, n = 0;
+	
+	for(i = 0; i < arrlen(base); ++i) {
+		const bench_rec *b = &base[i];
+		if(strcmp(b->file, r->file) || strcmp(b->dither, r->dither)
+		|| strcmp(b->format, r->format)) continue;
+		
+		for(k = 0; k <= STAGES; ++k) {
+			if(b->ms[k] < BENCH_MIN_MS) continue;
+			if(r->ms[k] > b->ms[k]*(100 + BENCH_TOLERANCE)/100) {
+				printf("%s %s %s %s: %.3fms -> %.3fms (+%.0f%%)\n", 
+					r->file, r->dither, r->format, 
+					k < STAGES ? stage_names[k] : "total",
+					b->ms[k], r->ms[k], 100*(r->ms[k]/b->ms[k] - 1));
+				++n;
+			}
+		}
+		break;
+	}
+	
+	return n;
+}
 
-	if(buf==NULL) OUT_OF_MEM(3*256*256);
+PRIVATE void bench(void) {
+	const int csv = strlen(bench_file) >= 4 
+	             && !strcmp(bench_file + strlen(bench_file) - 4, ".csv");
+	bench_rec *base = NULL;
+	const char *scratch;
+	double (*t)[STAGES + 1], *v;
+	int i, d, fmt, run, k, first = TRUE, slower = 0, records = 0;
+	FILE *f;
 	
-	if(f==NULL) {perror(filename); return;}
+	if(bench_runs < 1) bench_runs = 1;
+	t = malloc(bench_runs*sizeof(*t));
+	v = malloc(bench_runs*sizeof(*v));
+	if(!t || !v) OUT_OF_MEM((int)(bench_runs*sizeof(*t)));
+	if(bench_baseline) base = bench_load(bench_baseline);
 	
-	if(verbose>1) {
-		printf("saving %s...", basename(filename));
-		fflush(stdout);
-	}
+	f = fopen(bench_file, "w");
+	if(f == NULL) {perror(bench_file); exit_code = 1; free(t); free(v); return;}
 	
-	for(i=0;i<65536;++i) {
-		int c = pic->bitmap[i]>=8 ? HALF_INTENSITY : FULL_INTENSITY;
-		*rgb++ = pic->bitmap[i] & 4 ? 0 : c;
-		*rgb++ = pic->bitmap[i] & 2 ? 0 : c;
-		*rgb++ = pic->bitmap[i] & 1 ? 0 : c;
+	/* the compression itself is timed, and the writing to a scratch file
+	   so that the outputs of the user are left alone */
+	store_dir = NULL;
+	scratch = path_format("%s.tmp", bench_file);
+	
+	for(i = 0; i < arrlen(jobs); ++i)
+	for(d = 0; dith_descriptors[d].name; ++d)
+	for(fmt = 0; fmt < (int)length_of(bench_formats); ++fmt) {
+		options o = jobs[i].opt;
+		bench_rec r;
+		
+		o.dith_descriptor = &dith_descriptors[d];
+		o.exo  = bench_formats[fmt].version == SQP_EXO;
+		o.zx0  = bench_formats[fmt].version == SQP_ZX0;
+		o.span = bench_formats[fmt].version == SQP_SPAN;
+		o.best = o.incremental = o.verify = FALSE;
+		o.decode_bench = 0;
+		o.verbose = 0;
+		
+		snprintf(r.file,   sizeof(r.file),   "%s", jobs[i].input_file);
+		snprintf(r.dither, sizeof(r.dither), "%s", o.dith_descriptor->name);
+		snprintf(r.format, sizeof(r.format), "%s", bench_formats[fmt].name);
+		r.runs  = bench_runs;
+		r.bytes = 0;
+		
+		for(run = 0; run < bench_runs; ++run) {
+			pic pic;
+			double t0;
+			
+			pic.opt = &o;
+			pic.wk  = &main_worker;
+			pic.src = NULL;
+			worker_init(&main_worker);
+			
+			if(!pic_convert(&pic, jobs[i].input_file)) break;
+			t0 = mono_time();
+			pic_save(&pic, scratch);
+			pic_stage(&pic, STAGE_WRITE, t0);
+			r.bytes = pic.saved_size;
+			
+			t[run][STAGES] = 0;
+			for(k = 0; k < STAGES; ++k) {
+				t[run][k] = 1000*pic.stage_time[k];
+				t[run][STAGES] += t[run][k];
+			}
+			pic_done(&pic);
+		}
+		if(run < bench_runs) continue;
+		
+		/* medians */
+		for(k = 0; k <= STAGES; ++k) {
+			for(run = 0; run < bench_runs; ++run) v[run] = t[run][k];
+			qsort(v, bench_runs, sizeof(*v), bench_cmp_double);
+			r.ms[k] = bench_runs & 1 ? v[bench_runs/2]
+			        : (v[bench_runs/2 - 1] + v[bench_runs/2])/2;
+		}
+		
+		bench_write(f, csv, &r, first);
+		first = FALSE;
+		++records;
+		if(jobs[i].verbose) {
+			printf("%s %s %s: %.1fms (", basename(r.file), r.dither, r.format, r.ms[STAGES]);
+			for(k = 0; k < STAGES; ++k) 
+				printf("%s%s %.1f", k ? ", " : "", stage_names[k], r.ms[k]);
+			printf(")\n");
+		}
+		if(base) slower += bench_compare(&r, base);
 	}
-
-	stbi_write_force_png_filter = 0;
-	stbi_write_png_compression_level = 1024;
-	stbi_write_png(filename, 256, 256, 3, buf, 3*256);
-     
-	free(buf);
+	if(!csv) fprintf(f, first ? "[]\n" : "\n]\n");
 	fclose(f);
-}
-
-PRIVATE void pic_save_gif(pic *pic, const char *filename) {
-	uint8_t palette[16*3];
-	ge_GIF *gif;
-	int i;
+	remove(scratch);
+	free((void*)scratch);
+	worker_flush(&main_worker);
 	
-	for(i=0; i<16; ++i) {
-		uint8_t c = (i>=8 ? HALF_INTENSITY : FULL_INTENSITY);
-		palette[3*i + 0] = i&4 ? 0 : c;
-		palette[3*i + 1] = i&2 ? 0 : c;
-		palette[3*i + 2] = i&1 ? 0 : c;
+	printf("%d configurations benchmarked to %s\n", records, bench_file);
+	if(base) {
+		printf("%d stages slower than in %s\n", slower, bench_baseline);
+		if(slower) exit_code = 1;
 	}
+	arrfree(base);
+	free(t);
+	free(v);
+}
 
-	gif = ge_new_gif(filename, 256, 256, palette, 4, -1, -1);
-	if(!gif) {perror(filename); return;}
+/* libsqpix (see libsqpix.h): sqpix.c built with SQPIX_LIB has no main()
+   but these calls. A context has its own options and worker, the dither
+   cache and the LRU order of the tetras staying warm from one call to 
+   the next (the ramps in cache being solved at the center of their cell,
+   this doesn't change the result), so that contexts can be used by as 
+   many threads. --serve runs on the same contexts. */
+struct sqpix {
+	options opt;
+	worker wk;
+	const struct dith_descriptor *dith;	/* of the ramps in cache */
+	uint8_t use_cache;
+	char **args;			/* of sqpix_options(), opt points in */
+	char error[sizeof(parse_error)];
+};
 
-	if(verbose>1) {
-		printf("saving %s...", basename(filename));
-		fflush(stdout);
-	}
-	memcpy(gif->frame, pic->bitmap, sizeof(pic->bitmap));
-	ge_add_frame(gif, 0);
-	ge_close_gif(gif);
-}
+#define SQPIX_ARGS	64
+
+PRIVATE pthread_once_t  lib_once  = PTHREAD_ONCE_INIT;
+PRIVATE pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
 
-PRIVATE vec3 *pic_get_linear_color(pic *pic, int x, int y, vec3 *ret) {
+/* splits the line in arguments after av[0], quotes protecting the spaces */
+PRIVATE int split_args(char *s, char **av, const int max) {
+	int ac = 0;
 	
-	if(x<0 || y<0 || x>=pic->w || y>=pic->h) {
-		vec3_set(ret, 0,0,0);
-	} else {
-		uint8_t *img = pic->sRGB + 3*(pic->w*y + x);
-		vec3_set(ret, sRGB2lin(img[0]), sRGB2lin(img[1]), sRGB2lin(img[2]));
+	av[ac++] = "sqpix";
+	while(ac < max) {
+		while(*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') ++s;
+		if(*s == '\0') break;
+		if(*s == '"') {
+			av[ac++] = ++s;
+			s += strcspn(s, "\"");
+		} else {
+			av[ac++] = s;
+			s += strcspn(s, " \t\r\n");
+		}
+		if(*s) *s++ = '\0';
 	}
 	
-	// vec3_set(ret, sRGB[112], sRGB[23], sRGB[25]);
-	// vec3_set(ret, 0.20792611981001, 0.02084547344562, 0.022794021361973);
-	
-	return ret;
+	return ac;
 }
 
-PRIVATE vec3 *squale_color(pic *pic, int x, int y, vec3 *ret) {
-	int x1, y1, x2, y2, i, j;
-	float k; vec3 p;
+/* parses the arguments over the options o, returning the input file in
+   *input (NULL for options only), or FALSE with the message in error. 
+   The other globals (-j, --store...) are left as they are. */
+PRIVATE int parse_args(options *o, int ac, char **av, char **input, 
+                       char error[sizeof(parse_error)]) {
+	int ok;
 	
-	if((pic->w==256 && pic->w>=pic->h)
-	|| (pic->h==256 && pic->h>=pic->w)) {
-		squale_coord(pic, x,y, &x1, &y1);
-		pic_get_linear_color(pic, x1, y1, ret);
-	} else {		
-		squale_coord(pic, x-1,y-1, &x1, &y1);
-		squale_coord(pic, x+1,y+1, &x2, &y2);
+	/* parse() works on the globals */
+	pthread_mutex_lock(&parse_lock);
+	do {
+		const options defaults = opt;
+		char *store = store_dir, *cache = cache_file, *stats = stats_file;
+		char *bench = bench_file, *base = bench_baseline, *serve = serve_path;
+		const int j = threads, runs = bench_runs;
 		
-		++x1; if(x1>=x2) x2 = x1+1;
-		++y1; if(y1>=y2) y2 = y1+1;
+		opt = *o;
+		parse_soft = TRUE;
+		ok = parse(1, ac, av);
+		if(ok >= 0 && ok < ac) {
+			snprintf(parse_error, sizeof(parse_error), 
+				"One input at a time: %s", av[ok]);
+			ok = -1;
+		} else if(ok >= 0 && (input == NULL) != (input_file == NULL)) {
+			if(input) snprintf(parse_error, sizeof(parse_error), 
+				"Missing input file");
+			else snprintf(parse_error, sizeof(parse_error), 
+				"Unexpected input file: %s", input_file);
+			ok = -1;
+		}
+		parse_soft = FALSE;
 		
-		k = 1.0f/((y2-y1)*(float)(x2-x1));
+		if(ok >= 0) *o = opt;
+		else strcpy(error, parse_error);
+		if(input) *input = input_file;
 		
+		opt = defaults;
+		store_dir = store; cache_file = cache; stats_file = stats;
+		bench_file = bench; bench_baseline = base; serve_path = serve;
+		threads = j; bench_runs = runs;
+	} while(0);
+	pthread_mutex_unlock(&parse_lock);
+	
+	return ok >= 0;
+}
 
-		vec3_set(ret, 0,0,0);
-		for(i=x1; i<x2; ++i) for(j = y1; j<y2; ++j) {
-			vec3_madd(ret, ret, k, pic_get_linear_color(pic, i,j, &p));
-		}
-		
-		// (*ret)[0] = x/255.0f;	
-		// (*ret)[1] = y/255.0f;	
-		// (*ret)[2] = 0;	
-	}
+/* converts the input of the pic with the worker of ctx */
+PRIVATE int ctx_convert(struct sqpix *ctx, pic *pic, const options *o, 
+                        const char *input) {
+	int ok;
 	
-	if(pic->norm_0 > 0) {
-		const float x0  = pic->norm_0, x1 = pic->norm_1;
-		float * const v = *ret, t;
-		t = (v[0]-x0)*x1; v[0] = t<=0 ? 0 : t>=1 ? 1 : t;
-		t = (v[1]-x0)*x1; v[1] = t<=0 ? 0 : t>=1 ? 1 : t;
-		t = (v[2]-x0)*x1; v[2] = t<=0 ? 0 : t>=1 ? 1 : t;
-	}
-			
-	return ret;
+	pic->opt = o;
+	pic->wk  = &ctx->wk;
+	
+	/* the ramps in cache depend on the matrix */
+	if(o->dith_descriptor != ctx->dith || o->use_cache != ctx->use_cache 
+	|| worker_cache_len(&ctx->wk) >= 65536) worker_flush(&ctx->wk);
+	ok = pic_convert(pic, input);
+	ctx->dith = o->dith_descriptor;
+	ctx->use_cache = o->use_cache;
+	
+	return ok;
 }
 
-PRIVATE void pic_dither(pic *pic, int x, int y) {
-	vec3 p; 
+sqpix *sqpix_new(void) {
+	struct sqpix *ctx;
 	
-	uint8_t c = dith(dith_descriptor,  x, y, 
-	  		 squale_color(pic, x, y, &p));
+	pthread_once(&lib_once, init);
+	ctx = calloc(1, sizeof(*ctx));
+	if(!ctx) return NULL;
+	pthread_mutex_lock(&parse_lock);
+	ctx->opt = opt;
+	pthread_mutex_unlock(&parse_lock);
+	worker_init(&ctx->wk);
 	
-	pic->bitmap[x + y*256] = c; //*0+(((x/30)+(y/30))%14);
+	return ctx;
 }
 
-// hilbert cuve improve cache hits
-PRIVATE void pic_conv_h(pic *pic) {
-	static int dir[] = {256,1,-256,-1}, a, l = 8, b = 1;
-	static unsigned int p = 0;
-	if(pic==NULL)  {
-		l = 8;
-		b = 1;
-		p = 0;
-		a = 0;
-	} else if(l == 0) {
-		pic_dither(pic, p & 255, p>>8);
-	} else {
-		--l;
-		a -= (b=-b); 
-		pic_conv_h(pic);
-		p = p + dir[a&3]; 
-		a -= (b=-b); 
-		pic_conv_h(pic);
-		p = p + dir[a&3]; 
-		pic_conv_h(pic);
-		a += (b=-b); 
-		p = p + dir[a&3]; 
-		pic_conv_h(pic); 
-		a += (b=-b);		
-		++l;
+void sqpix_free(sqpix *ctx) {
+	if(ctx) {
+		int i;
+		for(i = 0; i < arrlen(ctx->args); ++i) free(ctx->args[i]);
+		arrfree(ctx->args);
+		worker_flush(&ctx->wk);
+		free(ctx);
 	}
 }
 
-PRIVATE void pic_conv_l(pic *pic) {
-	int i;
-	for(i=0;i<65536;++i) pic_dither(pic, i & 255, i>>8);
+int sqpix_options(sqpix *ctx, const char *args) {
+	char *av[SQPIX_ARGS], *s = strdup(args);
+	int ok;
+	
+	if(!s) OUT_OF_MEM((int)strlen(args));
+	ok = parse_args(&ctx->opt, split_args(s, av, SQPIX_ARGS), av, NULL, ctx->error);
+	arrput(ctx->args, s);
+	
+	return ok ? 0 : -1;
 }
 
-PRIVATE void init(void) {
-	static uint16_t tetras_desc[] = {
-#if HALF_INTENSITY==187
-		0x0518, 0x0458, 0x0248, 0x4268, 
-		0x0328, 0x0138, 0x1389, 0x5189, 
-		0x682A, 0x328A, 0x3A8B, 0x8A7B, 
-		0x879B, 0x389B, 0x584C, 0x486C, 
-		0x87CD, 0x58CD, 0x897D, 0x598D, 
-		0x78CE, 0x6C8E, 0x68AE, 0x7A8E
-#elif HALF_INTENSITY==157
-		0x4268, 0x0328, 0x0138, 0x5048, 
-		0x0248, 0x5108, 0x1389, 0x5189, 
-		0x283A, 0x268A, 0x879B, 0x389B, 
-		0x8A7B, 0x3A8B, 0x486C, 0x584C, 
-		0x58CD, 0x598D, 0x789D, 0x7C8D, 
-		0x86CE, 0x7A8E, 0x8A6E, 0x78CE
-#else
-		// 0x0138, 0x0248, 0x4268, 0x0518, 
-		// 0x0458, 0x0328, 0x1389, 0x1859, 
-		// 0x283A, 0x268A, 0x78AB, 0x798B, 
-		// 0x389B, 0x3A8B, 0x486C, 0x458C, 
-		// 0x859D, 0x789D, 0x7C8D, 0x8C5D, 
-		// 0x8A6E, 0x7A8E, 0x78CE, 0x86CE
-		// 0x2648, 0x0328, 0x1058, 0x0248, 0x0458, 0x1308, 0x1389, 0x1859, 0x328A, 0x268A, 0x78AB, 0x798B, 0x389B, 0x3A8B, 0x486C, 0x458C, 0x789D, 0x859D, 0x7C8D, 0x8C5D, 0x68AE, 0x7A8E, 0x78CE, 0x6C8E
-		// 0x1048, 0x2138, 0x2608, 0x0648, 0x1458, 0x2018, 0x1859, 0x1389, 0x268A, 0x283A, 0x3A8B, 0x78AB, 0x389B, 0x798B, 0x584C, 0x486C, 0x8C5D, 0x859D, 0x7C8D, 0x789D, 0x86CE, 0x8A6E, 0x78CE, 0x7A8E
-		// 0x0268, 0x5108, 0x0648, 0x1208, 0x1328, 0x5048, 0x1389, 0x1859, 0x283A, 0x268A, 0x879B, 0x389B, 0x8A7B, 0x3A8B, 0x486C, 0x458C, 0x897D, 0x598D, 0x87CD, 0x58CD, 0x7A8E, 0x6C8E, 0x78CE, 0x68AE
-		// 0x0138, 0x0328, 0x4518, 0x6408, 0x0418, 0x6028, 0x5189, 0x1389, 0x832A, 0x826A, 0x389B, 0x78AB, 0x3A8B, 0x798B, 0x648C, 0x584C, 0x58CD, 0x789D, 0x598D, 0x7C8D, 0x8C7E, 0x6C8E, 0x68AE, 0x87AE
-		// 0x6428, 0x0458, 0x3208, 0x3018, 0x0518, 0x0248, 0x1859, 0x3819, 0x283A, 0x682A, 0x3A8B, 0x78AB, 0x389B, 0x798B, 0x458C, 0x486C, 0x598D, 0x58CD, 0x7C8D, 0x789D, 0x68AE, 0x6C8E, 0x78CE, 0x7A8E
-		0x0128, 0x0518, 0x0268, 0x0648, 
-		0x1328, 0x0458, 0x1389, 0x1859, 
-		0x328A, 0x826A, 0x3A8B, 0x78AB, 
-		0x389B, 0x798B, 0x458C, 0x648C, 
-		0x789D, 0x58CD, 0x598D, 0x7C8D, 
-		0x86CE, 0x78CE, 0x7A8E, 0x8A6E
-#endif
-	};
+const char *sqpix_error(const sqpix *ctx) {
+	return ctx->error;
+}
+
+int sqpix_convert(sqpix *ctx, const unsigned char *rgb, int w, int h,
+                  unsigned char **sqp, int *len, unsigned char *preview) {
+	pic *pic;
+	int ok;
+	
+	*sqp = NULL; *len = 0;
+	if(rgb == NULL || w <= 0 || h <= 0) {
+		snprintf(ctx->error, sizeof(ctx->error), "Invalid image: %dx%d", w, h);
+		return -1;
+	}
+	
+	pic = malloc(sizeof(*pic));
+	if(!pic) OUT_OF_MEM((int)sizeof(*pic));
+	pic->src   = rgb;
+	pic->src_w = w;
+	pic->src_h = h;
+	
+	ok = ctx_convert(ctx, pic, &ctx->opt, "rgb");
+	if(ok) {
+		*len = membuf_memlen(&pic->sqp);
+		*sqp = malloc(*len);
+		if(!*sqp) OUT_OF_MEM(*len);
+		memcpy(*sqp, membuf_get(&pic->sqp), *len);
+		if(preview) {
+			uint8_t *buf = pic_rgb(pic);
+			memcpy(preview, buf, 3*65536);
+			free(buf);
+		}
+	} else snprintf(ctx->error, sizeof(ctx->error), "Can't convert the image");
+	pic_done(pic);
+	free(pic);
+	
+	return ok ? 0 : -1;
+}
+
+/* --serve: converts the requests of clients, keeping the dither caches
+   and the LRU orders of the tetras warm from one request to the next.
+   They make it faster, but don't change the result: a request gets the 
+   bytes of the command-line, whatever was converted before.
+   The clients connect to a unix domain socket, each one being served by
+   one of the -j workers, or a single client talks on stdin/stdout.
+   
+   A request is a line with the arguments of a command-line: options, 
+   then the input file. "@<size>" as input file stands for the <size> 
+   bytes of the image following the line. The options of the server are
+   the defaults. The response is "OK <sqp> <png>\n" followed by the 
+   bytes of the SQP file then of the preview (with --png, 0 bytes 
+   otherwise), or "ERR <message>\n". Nothing is written to the disk but 
+   the --store. The other global options (-j, --store...) can only be 
+   given to the server. */
+#define SERVE_LINE	4096
+#define SERVE_MAX_SIZE	(64<<20)	/* bytes of an image */
+
+PRIVATE pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE pthread_cond_t  serve_cond = PTHREAD_COND_INITIALIZER;
+PRIVATE int *serve_clients;		/* sockets waiting for a worker */
+
+/* answers a request, returning FALSE when the connection is broken */
+PRIVATE int serve_request(sqpix *worker, char *line, FILE *in, FILE *out) {
+	char *av[SQPIX_ARGS], *input, error[sizeof(parse_error)];
+	const int ac = split_args(line, av, SQPIX_ARGS);
+	options o = worker->opt;	/* the ones of the server */
+	struct membuf png;
+	uint8_t *src = NULL;
+	long len = 0;
+	pic *pic;
 	int i;
 	
-	stbds_rand_seed(time(0));	
+	if(ac == 1) return TRUE;	/* empty line */
 	
-	for(i=0; i<15; ++i) {
-		float c = sRGB2lin(i>=8 ? HALF_INTENSITY : FULL_INTENSITY);
-		set_palette(i, i&4 ? 0.0f : c,
-		               i&2 ? 0.0f : c,
-			       i&1 ? 0.0f : c);
+	/* the bytes are read first, so that the next request is found 
+	   even if this one is wrong */
+	for(i = 1; i < ac; ++i) if(av[i][0] == '@') {
+		len = atol(av[i] + 1);
+		if(len <= 0 || len > SERVE_MAX_SIZE) {
+			fprintf(out, "ERR Invalid size: %s\n", av[i]);
+			return FALSE;
+		}
+		src = malloc(len);
+		if(!src) OUT_OF_MEM((int)len);
+		if(fread(src, 1, len, in) != (size_t)len) {free(src); return FALSE;}
+		break;
 	}
-
-	for(i=0; i<length_of(tetras_desc); ++i) {
-		uint16_t x = tetras_desc[i];
-		new_tetra(&tetras[i], 
-			  x>>12,(x>>8)&15,
-			  (x>>4)&15,x&15);
+	
+	if(!parse_args(&o, ac, av, &input, error)) {
+		fprintf(out, "ERR %s\n", error);
+		free(src);
+		return fflush(out) == 0;
+	}
+	if(input[0] == '@' && src == NULL) {
+		fprintf(out, "ERR Missing bytes: %s\n", input);
+		return fflush(out) == 0;
+	}
+	
+	/* stdout may be the connection */
+	o.verbose = 0;
+	
+	pic = malloc(sizeof(*pic));
+	if(!pic) OUT_OF_MEM((int)sizeof(*pic));
+	pic->src = src;
+	pic->src_len = len;
+	pic->src_w = 0;
+	
+	if(!ctx_convert(worker, pic, &o, input)) 
+		fprintf(out, "ERR Can't convert %s\n", input);
+	else {
+		membuf_init(&png);
+		if(o.png) pic_png(pic, &png);
+		fprintf(out, "OK %d %d\n", membuf_memlen(&pic->sqp), membuf_memlen(&png));
+		fwrite(membuf_get(&pic->sqp), 1, membuf_memlen(&pic->sqp), out);
+		fwrite(membuf_get(&png), 1, membuf_memlen(&png), out);
+		membuf_free(&png);
 	}
+	pic_done(pic);
+	free(pic);
+	free(src);
 	
-	dith_descriptor = dith_find("hex"); // this one seem pretty nice
-	aspect_ratio = 1.0f;
-	norm_w = norm_b = -1.0f;
+	return fflush(out) == 0;
 }
 
-PRIVATE void usage(char *av0) {
-	int i;
+PRIVATE void serve_client(sqpix *worker, FILE *in, FILE *out) {
+	char line[SERVE_LINE];
 	
-	printf("Usage: %s [options] <image.ext> ...\n", av0);
-	printf("options:\n");
-	printf(" ?, -h, --help : Prints this help\n");
+	while(fgets(line, sizeof(line), in)) {
+		if(strchr(line, '\n') == NULL && !feof(in)) {
+			fprintf(out, "ERR Request too long\n");
+			break;
+		}
+		if(!serve_request(worker, line, in, out)) break;
+	}
+	fflush(out);
+}
 
-	printf(" -v             : Verbose\n");
-	printf(" -o <name>      : Specify output file "
-		"(accepted patterns: %%s, %%p, %%n, %%e, %%N, %%E)\n");
-	printf(" -x             : same as --o4\n");
-	printf(" -z             : same as --exo\n");
-	printf(" -r <w:h>       : same as --ratio\n");
-	printf("\n");
-	
-	printf(" --exo          : Compresses with exomizer\n");
-	printf(" --zx0          : Compresses with ZX0/Salvador\n");
-	printf(" --gif          : Output gif image (for preview)\n");
-	printf(" --png          : Output png image (for preview)\n");
-	printf(" --pgm          : Output pgm image (for preview)\n");
-	printf(" --low          : Low quality resizing\n");
-	printf(" --ratio <w:h>  : Sets aspect ratio (default=1:1)\n");
-	printf(" --norm [<b:w>] : Normalize levels (typical=1.0:99.9)\n");
-	printf(" --no-cache     : Disable dither cache\n");
-	printf("\n");
+#ifndef _WIN32
+PRIVATE void *serve_thread(void *arg) {
+	sqpix *worker = arg;
 	
-	for(i=0; dith_descriptors[i].name; ++i)
-	printf(" --%-12s : %s\n", dith_descriptors[i].name, dith_descriptors[i].desc);
+	for(;;) {
+		FILE *in, *out;
+		int fd;
+		
+		pthread_mutex_lock(&serve_lock);
+		while(arrlen(serve_clients) == 0) 
+			pthread_cond_wait(&serve_cond, &serve_lock);
+		fd = serve_clients[0];
+		arrdel(serve_clients, 0);
+		pthread_mutex_unlock(&serve_lock);
+		
+		in  = fdopen(fd, "rb");
+		out = in ? fdopen(dup(fd), "wb") : NULL;
+		if(out) serve_client(worker, in, out);
+		if(out) fclose(out);
+		if(in) fclose(in); else close(fd);
+	}
 	
-	exit(0);
+	return NULL;
 }
+#endif
 
-PRIVATE int parse(int i, int ac, char **av) {
-	for(input_file = NULL; i<ac && input_file==NULL; ++i) {
-		if(!strcmp("?", av[i])
-		|| !strcmp("-h", av[i])
-		|| !strcmp("--help", av[i])
-		|| 0) usage(av[0]);
+PRIVATE sqpix *serve_worker(void) {
+	sqpix *worker = sqpix_new();
+	if(!worker) OUT_OF_MEM((int)sizeof(*worker));
+	return worker;
+}
 
-		else if(!strcmp("-v", av[i])) 
-			verbose = 1;
-		else if(!strcmp("--debug", av[i])) 
-			verbose = 2;
-		else if(!strcmp("-o", av[i]) && i<ac-1)
-			output_file = av[++i];
-		else if(!strcmp("-x", av[i])) 
-			dith_descriptor = dith_find("o4");
-		else if(!strcmp("--no-cache", av[i])) 
-			use_cache = FALSE;
-		else if(!strcmp("--exo", av[i])
-                     || !strcmp("-z",   av[i]))
-			exo = TRUE;
-		else if(!strcmp("--zx0", av[i]))
-			zx0 = TRUE;
-		else if(!strcmp("--pgm", av[i])) 
-			pgm = TRUE;
-		else if(!strcmp("--png", av[i])) 
-			png = TRUE;
-		else if(!strcmp("--gif", av[i])) 
-			gif = TRUE;
-		else if(!strcmp("--low", av[i])) 
-			hq_zoom = FALSE;
-		else if(!strcmp("--norm", av[i])) {
-			char *s = i<ac-1 ? av[i+1] : NULL;
-			float x = -1, y = -1;
-			if(s && 2==sscanf(s, "%f:%f", &x, &y)) {++i;}   else
-			if(s && 1==sscanf(s, ":%f", &y)) {x = -1; ++i;} else
-			if(s && 1==sscanf(s, "%f:", &x)) {y = -1; ++i;}
-			else {x = 1.0f; y = 99.9f;}
-			norm_b = x< 0 || x>=100 ? -1 : x/100.0f;
-			norm_w = y<=0 || y> 100 ? -1 : y/100.0f;
-			if(0 <= norm_w && norm_w <= norm_b) norm_b = norm_w = -1;
-		} 
-		else if(i<ac-1 && (
-			 !strcmp("--ratio", av[i]) ||
-			 !strcmp("-r", av[i])
-			 )) {
-			char *s = av[++i];		
-			float x,y;
-			if(sscanf(s, "%f:%f", &x, &y) != 2) {
-				y = 1.0f;
-				if(sscanf(s,"%f", &x) != 1) {
-					x = y = -1.0f;
-				}
-			}
-			if(y<=0) {
-				fprintf(stderr, "Invalid ratio: %s\n" , av[i]);
-				exit(-1);
-			}
-			aspect_ratio = fabsf(x/y);
-		} 
-		else if(!strncmp("--", av[i], 2)) {
-			dith_descriptor = dith_find(av[i]+2);
-			if(!dith_descriptor) FATAL("Unknown dither: --%s", av[i]+2, -1);
+PRIVATE void serve(void) {
+	if(!strcmp(serve_path, "-")) {
+		sqpix *worker = serve_worker();
+#ifdef _WIN32
+		_setmode(_fileno(stdin),  _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		serve_client(worker, stdin, stdout);
+		sqpix_free(worker);
+		return;
+	}
+#ifdef _WIN32
+	FATAL("Unix sockets are not supported, use --serve -%s", "", -1);
+#else
+	do {
+		struct sockaddr_un addr;
+		int fd, i, n = threads > 0 ? threads : cpu_count();
+		
+		if(strlen(serve_path) >= sizeof(addr.sun_path)) 
+			FATAL("Socket path too long: %s", serve_path, -1);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, serve_path);
+		
+		/* a client leaving early must not kill the server */
+		signal(SIGPIPE, SIG_IGN);
+		
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0) FATAL("Can't create socket: %s", strerror(errno), -1);
+		unlink(serve_path);
+		if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16))
+			FATAL("Can't listen on %s", serve_path, -1);
+		
+		if(n <= 0) n = 1;
+		for(i = 0; i < n; ++i) {
+			pthread_t tid;
+			if(pthread_create(&tid, NULL, serve_thread, serve_worker()))
+			FATAL("Can't create thread %d", i, -1);
+			pthread_detach(tid);
 		}
-		else if(*av[i] != '-') {
-			FILE *f = fopen(av[i], "rb");
-			if(f) {fclose(f); input_file = av[i];}
-			else perror(av[i]);
+		if(opt.verbose) printf("serving on %s with %d workers\n", serve_path, n);
+		
+		for(;;) {
+			int c = accept(fd, NULL, NULL);
+			if(c < 0) {
+				if(errno == EINTR) continue;
+				perror(serve_path);
+				break;
+			}
+			pthread_mutex_lock(&serve_lock);
+			arrput(serve_clients, c);
+			pthread_cond_signal(&serve_cond);
+			pthread_mutex_unlock(&serve_lock);
 		}
-		else FATAL("Unknown argument: %s" , av[i], -1);
-	}
-	if(input_file == NULL) FATAL("Missing file after : %s", av[ac-1], -1);
-	return i;
+		close(fd);
+		unlink(serve_path);
+	} while(0);
+#endif
 }
 
+#ifndef SQPIX_LIB
 int main(int ac, char **av) {
+	const struct dith_descriptor *dith = NULL;
 	int i = 1;
 	
 	if(ac==1) usage(av[0]);
 	
-	init();
+	pthread_once(&lib_once, init);	/* as sqpix_new() */
 	do {
-		const char *out;
-		pic pic;
+		job job;
 		
 		i = parse(i, ac, av);
+		if(input_file == NULL) break;	/* --serve */
 		
-		if(!pic_load(&pic, input_file)) continue;
-		
-		pic_norm(&pic, norm_b, norm_w);
-		
-		// convert
-		if(hilbert) {
-			pic_conv_h(NULL);
-			pic_conv_h(&pic);
-		} else pic_conv_l(&pic);
-		if(verbose > 1 && use_cache) printf("%d cache entries (%dkb, %.1f%%)...", 
-			hmlen(dith_cache),
-			(hmlen(dith_cache)*sizeof(*dith_cache))/1024, 
-			100*dith_hit/dith_total);
-
-		out = path_format(output_file, input_file);
-		if(strstr(output_file, "%N") != NULL) {
-			FILE *f = fopen(out, "rb");
-			if(f) { fclose(f);
-				int32_t crc = pic_crc32(&pic) % 1291;
-				int n = strlen(out), l = n+3;
-				char *tmp = malloc(l); if(!tmp) OUT_OF_MEM(l);
-				strcpy(tmp, out);
-								
-				while(n>0 && tmp[n-1]!='/' && tmp[n-1]!='\\') --n;
-				for(l=0; tmp[n+l] && tmp[n+l]!='.'; ++l);
-				
-				if(l<8) {
-					int l2 = l;
-					
-					tmp[n + l++] = ' '; 
-					if(l<8) tmp[n + l++] = ' '; 
-					
-					strcpy(tmp + n + l, out + n + l2);
-				}
-				n += l-2;
-				l = crc%36; crc/=36; tmp[n++] = l<10? '0'+l : 'A'+l-10;
-				l = crc%36; crc/=36; tmp[n++] = l<10? '0'+l : 'A'+l-10;
-				free((void*)out);
-				out = tmp;
-			}
-		}
-
-		// overview
-		if(pgm) {
-			const char *s = path_format("%s.pgm", out);
-			pic_save_pgm(&pic, s);
-			free((void*)s);
-		}
-		if(png) {
-			const char *s = path_format("%s.png", out);
-			pic_save_png(&pic, s);
-			free((void*)s);
-		}
-		if(gif) {
-			const char *s = path_format("%s.gif", out);
-			pic_save_gif(&pic, s);
-			free((void*)s);
-		}
-		
-		// save
-		pic_save(&pic, out);
+		job.input_file = input_file;
+		job.opt        = opt;
+		job.verbose    = opt.verbose;
+		/* stdout is for the SQP file */
+		if(!strcmp(opt.output_file, "-")) job.opt.verbose = job.verbose = 0;
+		job.done       = FALSE;
+		job.skipped    = FALSE;
+		job.pic        = NULL;
+		arrput(jobs, job);
+	} while(i<ac);
+	
+	if(cache_file) dith_store_open(cache_file);
+	if(stats_file && (stats_out = fopen(stats_file, "w")) == NULL) 
+		FATAL("Can't write %s", stats_file, -1);
+	
+	if(serve_path) serve();
+	else if(bench_file) bench();
+	else if(threads > 0) {
+		/* workers are silent, messages are printed when writing */
+		for(i=0; i<arrlen(jobs); ++i) jobs[i].opt.verbose = 0;
+		run_jobs(threads);
+	} else for(i=0; i<arrlen(jobs); ++i) {
+		pic pic;
 		
-		// done
-		pic_done(&pic);
-		free((void*)out);
+		pic.opt = &jobs[i].opt;
+		pic.wk  = &main_worker;
+		pic.src = NULL;
 		
-		if(hmlen(dith_cache)>=65536) {
-			hmfree(dith_cache);
-			dith_hit = dith_total = 0;
+		if(pic_uptodate(&pic, jobs[i].input_file)) {
+			if(jobs[i].verbose) printf("%s...up to date\n", 
+				basename(jobs[i].input_file));
+			continue;
 		}
-	} while(i<ac);
+		/* the ramps in cache depend on the matrix */
+		if(pic.opt->dith_descriptor != dith) worker_flush(&main_worker);
+		dith = pic.opt->dith_descriptor;
+		if(!pic_convert(&pic, jobs[i].input_file)) continue;
+		pic_commit(&pic, jobs[i].input_file);
+		
+		if(worker_cache_len(&main_worker)>=65536) 
+			worker_flush(&main_worker);
+	}
 	
-	return 0;
-}
\ No newline at end of file
+	if(cache_file) dith_store_close(opt.verbose);
+	if(stats_out) fclose(stats_out);
+	if(decode_time > 0) printf("decoded at %.1f Mpixels/s\n", 
+		decode_pixels/decode_time/1000000);
+	arrfree(jobs);
+	
+	return exit_code;
+}
+#endif